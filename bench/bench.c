@@ -0,0 +1,483 @@
+/*
+ * Rasteriser Microbenchmarks.
+ * Times the drawing primitives on a headless device and prints one record per
+ * case as CSV or JSON, so results can be compared across commits.
+ *
+ * "pixels" is the number of pixel stores a repetition does; for the full
+ * timetable frame it is the frame area, which keeps resolutions comparable.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dlist.h>
+#include <draw.h>
+#include <format.h>
+#include <headless.h>
+#include <kernels.h>
+#include <perfctr.h>
+#include <shadow.h>
+#include <utils.h>
+#include <wall.h>
+#include <workers.h>
+
+#define MAX_CASES 64
+#define PLOT_BATCH 4096
+/* largest -t, as for drm_timetables */
+#define MAX_THREADS 256
+/* cell size of the wall case, 144 figures at 1080p and 576 at 4K */
+#define WALL_CELL 120
+
+struct bench_ctx {
+  struct drm_dev dev;
+  struct tt_geometry geo;
+  size_t max_points;
+  size_t reps;
+  size_t rep;
+  vec2 plot_pts[PLOT_BATCH];
+  /* display list replayed by dl_frame, frames taken in turn */
+  struct dlist dl;
+  const struct dlist_frame *dl_frame;
+  /* grid of small timetables drawn by the wall case */
+  struct tt_wall wall;
+};
+
+struct bench_case {
+  char name[32];
+  void (*run)(struct bench_ctx *ctx, const struct bench_case *bc);
+  uint64_t pixels;
+  vec2 p0, p1;
+  int radius;
+  int batch;
+  const struct pixel_kernels *kernels;
+  bool stream;
+};
+
+struct bench_result {
+  uint64_t min, p50, p90, p99;
+  double mean;
+};
+
+static const color white = {0xff, 0xff, 0xff};
+
+static void run_plot(struct bench_ctx *ctx, const struct bench_case *bc) {
+  (void)bc;
+  for (size_t i = 0; i < PLOT_BATCH; i++)
+    plot(&ctx->dev, ctx->plot_pts[i].x, ctx->plot_pts[i].y, white);
+}
+
+static void run_line(struct bench_ctx *ctx, const struct bench_case *bc) {
+  for (int i = 0; i < bc->batch; i++)
+    draw_line(&ctx->dev, bc->p0, bc->p1, white);
+}
+
+static void run_ellipse(struct bench_ctx *ctx, const struct bench_case *bc) {
+  for (int i = 0; i < bc->batch; i++)
+    draw_ellipse(&ctx->dev, bc->p0, bc->radius, bc->radius, white);
+}
+
+static void run_fill_ellipse(struct bench_ctx *ctx,
+                             const struct bench_case *bc) {
+  for (int i = 0; i < bc->batch; i++)
+    fill_ellipse(&ctx->dev, bc->p0, bc->radius, bc->radius * 3 / 4, white);
+}
+
+static void run_clear(struct bench_ctx *ctx, const struct bench_case *bc) {
+  struct drm_buf *buf = drm_back_buf(&ctx->dev);
+  (void)bc;
+  /* clear only wipes what was drawn, make that all of the buffer */
+  ctx->dev.dirty = (struct drm_rect){0, 0, buf->width, buf->height};
+  clear(&ctx->dev);
+}
+
+/* plain memset over the whole mapping, the baseline for the fill kernels */
+static void run_memset(struct bench_ctx *ctx, const struct bench_case *bc) {
+  struct drm_buf *buf = drm_back_buf(&ctx->dev);
+  (void)bc;
+  memset(buf->map, 0, (size_t)buf->stride * buf->height);
+}
+
+static void run_fill(struct bench_ctx *ctx, const struct bench_case *bc) {
+  struct drm_buf *buf = drm_back_buf(&ctx->dev);
+  bc->kernels->fill(buf->map, buf->stride, buf->width * ctx->dev.format->cpp,
+                    buf->height,
+                    0x00102030, bc->stream);
+}
+
+static void run_tt_frame(struct bench_ctx *ctx, const struct bench_case *bc) {
+  /* sweep the whole animation over the repetitions */
+  uint32_t step = 2 * TT_STEP_ONE + (uint64_t)198 * TT_STEP_ONE * ctx->rep /
+                                        ctx->reps;
+  (void)bc;
+  draw_tt_frame(&ctx->dev, &ctx->geo, step, white);
+}
+
+static void run_dl_frame(struct bench_ctx *ctx, const struct bench_case *bc) {
+  const struct dlist_frame *f = dlist_next(&ctx->dl, ctx->dl_frame);
+  (void)bc;
+  if (!f)
+    f = dlist_next(&ctx->dl, NULL);
+  draw_frame(&ctx->dev, f->c, f->a, f->b, dlist_segs(f), f->nsegs,
+             dlist_color(f));
+  ctx->dl_frame = f;
+}
+
+static void run_wall(struct bench_ctx *ctx, const struct bench_case *bc) {
+  (void)bc;
+  /* the figures wrap around, only the frame count runs out */
+  ctx->wall.frames = 0;
+  tt_wall_frame(&ctx->wall, &ctx->dev);
+}
+
+static void run_tt_flip(struct bench_ctx *ctx, const struct bench_case *bc) {
+  run_tt_frame(ctx, bc);
+  flip_buffer(&ctx->dev);
+}
+
+/* the chords of one timetable frame, drawn one by one or as a batch */
+static void run_chords_loop(struct bench_ctx *ctx, const struct bench_case *bc) {
+  (void)bc;
+  for (size_t i = 0; i < ctx->max_points; i++)
+    draw_line(&ctx->dev, ctx->geo.segs[i].p0, ctx->geo.segs[i].p1, white);
+}
+
+static void run_chords_batch(struct bench_ctx *ctx,
+                             const struct bench_case *bc) {
+  (void)bc;
+  draw_lines(&ctx->dev, ctx->geo.segs, ctx->max_points, white);
+}
+
+static uint64_t count_lit(struct drm_dev *dev) {
+  struct drm_buf *buf = drm_back_buf(dev);
+  uint8_t *map = dev->shadow ? dev->shadow : buf->map;
+  uint32_t cpp = dev->format->cpp;
+  uint64_t n = 0;
+
+  for (uint32_t y = 0; y < buf->height; y++) {
+    uint8_t *row = map + (size_t)y * buf->stride;
+    for (uint32_t x = 0; x < buf->width * cpp; x += cpp)
+      n += cpp == 2 ? *(uint16_t *)&row[x] != 0 : *(uint32_t *)&row[x] != 0;
+  }
+  return n;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, unsigned p) {
+  size_t i = (n * p + 99) / 100;
+  return sorted[i ? i - 1 : 0];
+}
+
+static void bench_run(struct bench_ctx *ctx, const struct bench_case *bc,
+                      size_t warmup, uint64_t *samples,
+                      struct bench_result *res) {
+  double sum = 0;
+
+  for (size_t i = 0; i < warmup; i++) {
+    ctx->rep = i % ctx->reps;
+    bc->run(ctx, bc);
+  }
+  for (size_t i = 0; i < ctx->reps; i++) {
+    ctx->rep = i;
+    uint64_t start = now_ns();
+    bc->run(ctx, bc);
+    samples[i] = now_ns() - start;
+    sum += samples[i];
+  }
+  qsort(samples, ctx->reps, sizeof(*samples), cmp_u64);
+  res->min = samples[0];
+  res->p50 = percentile(samples, ctx->reps, 50);
+  res->p90 = percentile(samples, ctx->reps, 90);
+  res->p99 = percentile(samples, ctx->reps, 99);
+  res->mean = sum / ctx->reps;
+}
+
+static void add_line(struct bench_case *bc, const char *kind, int octant,
+                     vec2 c, int dx, int dy, int batch) {
+  snprintf(bc->name, sizeof(bc->name), "line_%s_o%d", kind, octant);
+  bc->run = run_line;
+  bc->p0 = c;
+  bc->p1.x = c.x + dx;
+  bc->p1.y = c.y + dy;
+  bc->batch = batch;
+  bc->pixels = (uint64_t)batch * ((abs(dx) > abs(dy) ? abs(dx) : abs(dy)) + 1);
+}
+
+static size_t build_cases(struct bench_ctx *ctx, struct bench_case *cases) {
+  uint32_t w = ctx->dev.mode.hdisplay, h = ctx->dev.mode.vdisplay;
+  vec2 c = {w / 2, h / 2};
+  int half = (w < h ? w : h) / 2 - 2;
+  int radii[] = {8, 64, 256, half};
+  /* major/minor component of each octant, counter-clockwise from +x */
+  static const int oct[8][2] = {{3, 1},  {1, 3},   {-1, 3}, {-3, 1},
+                                {-3, -1}, {-1, -3}, {1, -3}, {3, -1}};
+  size_t n = 0;
+
+  snprintf(cases[n].name, sizeof(cases[n].name), "plot");
+  cases[n].run = run_plot;
+  cases[n++].pixels = PLOT_BATCH;
+
+  for (int o = 0; o < 8; o++)
+    add_line(&cases[n++], "short", o, c, oct[o][0] * 5, oct[o][1] * 5, 256);
+  for (int o = 0; o < 8; o++)
+    add_line(&cases[n++], "long", o, c, oct[o][0] * half / 3,
+             oct[o][1] * half / 3, 4);
+
+  /* the axis-aligned and diagonal fast paths */
+  static const char *axis[3] = {"h", "v", "d"};
+  for (int i = 0; i < 3; i++) {
+    add_line(&cases[n], "long", 0, c, i != 1 ? half : 0, i ? half : 0, 4);
+    snprintf(cases[n].name, sizeof(cases[n].name), "line_long_%s", axis[i]);
+    n++;
+  }
+
+  for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); i++) {
+    if (radii[i] > half)
+      continue;
+    snprintf(cases[n].name, sizeof(cases[n].name), "fill_ellipse_r%d",
+             radii[i]);
+    cases[n].run = run_fill_ellipse;
+    cases[n].p0 = c;
+    cases[n].radius = radii[i];
+    cases[n].batch = 4;
+    clear(&ctx->dev);
+    fill_ellipse(&ctx->dev, c, radii[i], radii[i] * 3 / 4, white);
+    cases[n++].pixels = 4 * count_lit(&ctx->dev);
+
+    snprintf(cases[n].name, sizeof(cases[n].name), "ellipse_r%d", radii[i]);
+    cases[n].run = run_ellipse;
+    cases[n].p0 = c;
+    cases[n].radius = radii[i];
+    cases[n].batch = 4;
+    /* the ellipse overdraws a few pixels, so count them once */
+    clear(&ctx->dev);
+    draw_ellipse(&ctx->dev, c, radii[i], radii[i], white);
+    cases[n++].pixels = 4 * count_lit(&ctx->dev);
+  }
+
+  snprintf(cases[n].name, sizeof(cases[n].name), "clear");
+  cases[n].run = run_clear;
+  cases[n++].pixels = (uint64_t)w * h;
+
+  snprintf(cases[n].name, sizeof(cases[n].name), "clear_memset");
+  cases[n].run = run_memset;
+  cases[n++].pixels = (uint64_t)w * h;
+
+  const struct pixel_kernels *ks[8];
+  size_t nks = kernels_available(ks, 8);
+  for (size_t i = 0; i < nks; i++) {
+    for (int nt = 0; nt < 2; nt++) {
+      snprintf(cases[n].name, sizeof(cases[n].name), "fill_%s%s", ks[i]->name,
+               nt ? "_nt" : "");
+      cases[n].run = run_fill;
+      cases[n].kernels = ks[i];
+      cases[n].stream = nt;
+      cases[n++].pixels = (uint64_t)w * h;
+    }
+  }
+
+  snprintf(cases[n].name, sizeof(cases[n].name), "tt_frame");
+  cases[n].run = run_tt_frame;
+  cases[n++].pixels = (uint64_t)w * h;
+  if (tt_geometry_update(&ctx->geo, c, c.y - 10, ctx->max_points))
+    return 0;
+
+  /* includes the shadow upload when running with -s */
+  cases[n] = cases[n - 1];
+  snprintf(cases[n].name, sizeof(cases[n].name), "tt_frame_flip");
+  cases[n++].run = run_tt_flip;
+
+  /* leaves the chords of a mid-animation frame in geo.segs */
+  draw_tt_frame(&ctx->dev, &ctx->geo, 67 * TT_STEP_ONE + TT_STEP_ONE / 3,
+                white);
+  uint64_t chord_pixels = 0;
+  for (size_t i = 0; i < ctx->max_points; i++) {
+    int dx = abs(ctx->geo.segs[i].p1.x - ctx->geo.segs[i].p0.x);
+    int dy = abs(ctx->geo.segs[i].p1.y - ctx->geo.segs[i].p0.y);
+    chord_pixels += (dx > dy ? dx : dy) + 1;
+  }
+  snprintf(cases[n].name, sizeof(cases[n].name), "chords_loop");
+  cases[n].run = run_chords_loop;
+  cases[n++].pixels = chord_pixels;
+  snprintf(cases[n].name, sizeof(cases[n].name), "chords_batch");
+  cases[n].run = run_chords_batch;
+  cases[n++].pixels = chord_pixels;
+
+  if (!tt_wall_init(&ctx->wall, w, h, w / WALL_CELL, h / WALL_CELL,
+                    ctx->max_points, 1)) {
+    snprintf(cases[n].name, sizeof(cases[n].name), "wall");
+    cases[n].run = run_wall;
+    cases[n++].pixels = (uint64_t)w * h;
+  }
+
+  if (ctx->dl.map && dlist_next(&ctx->dl, NULL)) {
+    snprintf(cases[n].name, sizeof(cases[n].name), "dl_frame");
+    cases[n].run = run_dl_frame;
+    cases[n++].pixels = (uint64_t)w * h;
+  }
+
+  return n;
+}
+
+static void usage(const char *prog) {
+  ERROR("usage: %s [-r WxH] [-p max_points] [-n reps] [-w warmup] "
+        "[-f csv|json] [-F xrgb8888|rgb565|xrgb2101010] [-P] [-s] "
+        "[-t threads] [-l display_list] [-C]\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+  static struct bench_ctx ctx;
+  struct bench_case cases[MAX_CASES];
+  unsigned int width = 1920, height = 1080;
+  size_t warmup = 5, ncases;
+  bool json = false, hugepages = false, shadow = false;
+  uint64_t *samples;
+  unsigned int threads = 1;
+  const struct pixel_format *format = &format_xrgb8888;
+  int opt;
+
+  ctx.max_points = 200;
+  ctx.reps = 100;
+  while ((opt = getopt(argc, argv, "r:p:n:w:f:F:Pst:l:C")) != -1) {
+    switch (opt) {
+    case 'r':
+      if (sscanf(optarg, "%ux%u", &width, &height) != 2 || width < 64 ||
+          height < 64) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'p':
+      ctx.max_points = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      ctx.reps = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      warmup = strtoul(optarg, NULL, 0);
+      break;
+    case 'f':
+      json = !strcmp(optarg, "json");
+      break;
+    case 'F':
+      format = format_find(optarg);
+      if (!format) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'P':
+      hugepages = true;
+      break;
+    case 's':
+      shadow = true;
+      break;
+    case 't': {
+      unsigned long n = strtoul(optarg, NULL, 0);
+
+      if (n < 1 || n > MAX_THREADS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      threads = n;
+      break;
+    }
+    case 'C':
+      perfctr_enable();
+      break;
+    case 'l':
+      if (dlist_open(&ctx.dl, optarg)) {
+        ERROR("cannot open display list %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!ctx.max_points || !ctx.reps) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (headless_setup_dev(&ctx.dev, width, height, format, 2, hugepages)) {
+    ERROR("cannot set up headless device\n");
+    return EXIT_FAILURE;
+  }
+  if (shadow && shadow_enable(&ctx.dev)) {
+    ERROR("cannot allocate shadow buffer\n");
+    return EXIT_FAILURE;
+  }
+  if (threads > 1)
+    ctx.dev.pool = worker_pool_create(threads);
+  samples = malloc(ctx.reps * sizeof(*samples));
+  if (samples == NULL)
+    return EXIT_FAILURE;
+
+  for (size_t i = 0; i < PLOT_BATCH; i++) {
+    /* fixed LCG, so every run plots the same pattern */
+    static uint32_t seed = 1;
+    seed = seed * 1103515245 + 12345;
+    ctx.plot_pts[i].x = (seed >> 8) % width;
+    seed = seed * 1103515245 + 12345;
+    ctx.plot_pts[i].y = (seed >> 8) % height;
+  }
+  ncases = build_cases(&ctx, cases);
+
+  if (json)
+    printf("{\"resolution\": \"%ux%u\", \"format\": \"%s\", "
+           "\"max_points\": %zu, \"threads\": %u, \"reps\": %zu, "
+           "\"results\": [\n",
+           width, height, format->name, ctx.max_points,
+           worker_pool_threads(ctx.dev.pool), ctx.reps);
+  else
+    printf("case,width,height,format,max_points,threads,reps,pixels,min_ns,"
+           "p50_ns,p90_ns,p99_ns,mean_ns,ns_per_pixel,mpixels_per_s,per_s\n");
+
+  for (size_t i = 0; i < ncases; i++) {
+    struct bench_result res;
+    bench_run(&ctx, &cases[i], warmup, samples, &res);
+
+    double ns_px = (double)res.p50 / cases[i].pixels;
+    double mpx_s = 1e3 / ns_px;
+    double per_s = 1e9 / res.p50;
+    if (json)
+      printf("  {\"case\": \"%s\", \"pixels\": %llu, \"min_ns\": %llu, "
+             "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+             "\"mean_ns\": %.1f, \"ns_per_pixel\": %.4f, "
+             "\"mpixels_per_s\": %.2f, \"per_s\": %.2f}%s\n",
+             cases[i].name, (unsigned long long)cases[i].pixels,
+             (unsigned long long)res.min, (unsigned long long)res.p50,
+             (unsigned long long)res.p90, (unsigned long long)res.p99,
+             res.mean, ns_px, mpx_s, per_s, i + 1 < ncases ? "," : "");
+    else
+      printf("%s,%u,%u,%s,%zu,%u,%zu,%llu,%llu,%llu,%llu,%llu,%.1f,%.4f,"
+             "%.2f,%.2f\n",
+             cases[i].name, width, height, format->name, ctx.max_points,
+             worker_pool_threads(ctx.dev.pool), ctx.reps,
+             (unsigned long long)cases[i].pixels, (unsigned long long)res.min,
+             (unsigned long long)res.p50, (unsigned long long)res.p90,
+             (unsigned long long)res.p99, res.mean, ns_px, mpx_s, per_s);
+  }
+  if (json)
+    printf("]}\n");
+  /* the frame cases add up per stage, other cases do not count. stdout
+   * holds nothing but the records, so the table goes to stderr. */
+  perfctr_report(stderr);
+
+  free(samples);
+  tt_geometry_free(&ctx.geo);
+  tt_wall_free(&ctx.wall);
+  dlist_close(&ctx.dl);
+  drm_dev_teardown(&ctx.dev);
+  return EXIT_SUCCESS;
+}
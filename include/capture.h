@@ -0,0 +1,12 @@
+#pragma once
+
+#include "drm_helper.h"
+
+struct capture;
+
+struct capture *capture_open(const char *path, uint32_t width, uint32_t height,
+                             const struct pixel_format *format,
+                             unsigned int fps, unsigned int frames);
+void capture_frame(struct capture *cap, const uint8_t *pixels,
+                   uint32_t stride);
+void capture_close(struct capture *cap);
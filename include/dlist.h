@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "draw.h"
+
+/* A display list file is a dlist_header followed by one record per frame:
+ * a dlist_frame and then its nsegs segments. Every field is 32 or 64 bit in
+ * host byte order, so a mapped file hands its segments to the rasteriser as
+ * they are. */
+#define DLIST_MAGIC 0x4c445454u /* "TTDL" read as little endian */
+#define DLIST_VERSION 1
+
+struct dlist_header {
+  uint32_t magic;
+  uint32_t version;
+  /* size of the buffer the frames were recorded on */
+  uint32_t width, height;
+  uint32_t frames;
+  uint32_t reserved;
+  /* bytes of frame records after the header; frames and size stay 0 until
+   * dlist_finish, in a recording that was cut short */
+  uint64_t size;
+};
+
+struct dlist_frame {
+  /* bytes of this record, segments included */
+  uint32_t size;
+  /* colour of the frame as 0x00RRGGBB */
+  uint32_t rgb;
+  /* ellipse drawn under the lines, none if a is 0 */
+  vec2 c;
+  int32_t a, b;
+  uint32_t nsegs;
+};
+
+/* a display list mapped for playback */
+struct dlist {
+  uint8_t *map;
+  size_t len;
+  const struct dlist_header *hdr;
+  /* bytes of frame records to play */
+  uint64_t size;
+};
+
+int dlist_open(struct dlist *dl, const char *path);
+void dlist_close(struct dlist *dl);
+const struct dlist_frame *dlist_next(const struct dlist *dl,
+                                     const struct dlist_frame *f);
+
+static inline const segment *dlist_segs(const struct dlist_frame *f) {
+  return (const segment *)(f + 1);
+}
+
+static inline color dlist_color(const struct dlist_frame *f) {
+  return (color){(f->rgb >> 16) & 0xff, (f->rgb >> 8) & 0xff, f->rgb & 0xff};
+}
+
+struct dlist_writer;
+
+struct dlist_writer *dlist_create(const char *path, uint32_t width,
+                                  uint32_t height);
+int dlist_write(struct dlist_writer *w, color c, vec2 center, int a, int b,
+                const segment *segs, size_t n);
+int dlist_finish(struct dlist_writer *w);
@@ -13,8 +13,94 @@ typedef struct {
   int y;
 } vec2;
 
+typedef struct {
+  vec2 p0;
+  vec2 p1;
+} segment;
+
+/* The timetable multiplier is Q16.16 fixed point, so no floating point is
+ * needed per frame. */
+#define TT_STEP_SHIFT 16
+#define TT_STEP_ONE (1u << TT_STEP_SHIFT)
+/* 0.005 per frame, as far as Q16.16 gets */
+#define TT_STEP_INC 328u
+/* range an animation steps through */
+#define TT_STEP_FIRST (2 * TT_STEP_ONE)
+#define TT_STEP_LAST (200 * TT_STEP_ONE)
+/* the same pace in time with the governor, 0.005 per frame at 60 Hz */
+#define TT_STEP_PER_SEC (TT_STEP_INC * 60u)
+
+/* range the governor moves the point count of a timetable in */
+#define TT_POINTS_MIN 16
+#define TT_POINTS_MAX 20000
+
+/* The points on the circle of a timetable. They only depend on centre,
+ * radius and point count, so they are computed once and not per frame. */
+struct tt_geometry {
+  vec2 pos;
+  int r;
+  size_t max_points;
+  vec2 *pts;
+  /* scratch for the lines of one frame */
+  segment *segs;
+};
+
+struct dlist;
+struct dlist_frame;
+struct raster_target;
+
+/* Draws the figures of one strip of a draw_strips frame into t */
+typedef void (*strip_fn)(void *arg, const struct raster_target *t,
+                         unsigned int strip);
+struct dlist_writer;
+
+/* State of one running timetable animation */
+struct tt_anim {
+  struct tt_geometry geo;
+  uint32_t step;
+  /* added to step per frame, TT_STEP_INC unless changed */
+  uint32_t step_inc;
+  color c;
+  bool r_up, g_up, b_up;
+  /* state of the colour walk, see tt_anim_seed */
+  uint32_t rng;
+  size_t frames;
+  /* level of detail governor, see tt_anim_govern; budget 0 if off */
+  uint64_t budget_ns;
+  uint64_t start_ns;
+  uint64_t avg_ns;
+  size_t points;
+  unsigned int settle;
+  /* display list played instead, see tt_anim_play, and its last frame */
+  const struct dlist *play;
+  const struct dlist_frame *played;
+  /* display list recorded into, NULL if none */
+  struct dlist_writer *record;
+};
+
 void clear(struct drm_dev *dev);
 void plot(struct drm_dev *dev, int x, int y, color color);
+void fill_rect(struct drm_dev *dev, vec2 pos, int w, int h, color col);
 void draw_line(struct drm_dev *dev, vec2 p0, vec2 p1, color col);
+void draw_lines(struct drm_dev *dev, const segment *segs, size_t n, color col);
 void draw_ellipse(struct drm_dev *dev, vec2 c, int a, int b, color col);
-void draw_tt(struct drm_dev *dev, vec2 pos, int r, size_t max_points);
+void fill_ellipse(struct drm_dev *dev, vec2 c, int a, int b, color col);
+void draw_frame(struct drm_dev *dev, vec2 c, int a, int b,
+                const segment *segs, size_t n, color col);
+void draw_strips(struct drm_dev *dev, const struct drm_rect *area,
+                 uint32_t rows, strip_fn fn, void *arg);
+int tt_geometry_update(struct tt_geometry *geo, vec2 pos, int r,
+                       size_t max_points);
+void tt_geometry_free(struct tt_geometry *geo);
+void tt_geometry_chords(struct tt_geometry *geo, uint32_t step);
+void draw_tt_frame(struct drm_dev *dev, struct tt_geometry *geo,
+                   uint32_t step, color c);
+int tt_anim_init(struct tt_anim *anim, vec2 pos, int r, size_t max_points);
+void tt_anim_seed(struct tt_anim *anim, uint32_t seed);
+void tt_anim_next_color(struct tt_anim *anim);
+void tt_anim_govern(struct tt_anim *anim, uint64_t budget_ns);
+void tt_anim_play(struct tt_anim *anim, const struct dlist *dl);
+void tt_anim_record(struct tt_anim *anim, struct dlist_writer *w);
+bool tt_anim_frame(struct tt_anim *anim, struct drm_dev *dev);
+void tt_anim_free(struct tt_anim *anim);
+size_t draw_tt(struct drm_dev *dev, vec2 pos, int r, size_t max_points);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "drm_helper.h"
+
+/* property ids of the objects driving one output */
+struct drm_atomic {
+  uint32_t crtc_index;
+  uint32_t plane_id;
+  uint32_t mode_blob;
+  struct {
+    uint32_t active;
+    uint32_t mode_id;
+    uint32_t out_fence_ptr;
+  } crtc;
+  struct {
+    uint32_t crtc_id;
+  } conn;
+  struct {
+    uint32_t fb_id;
+    uint32_t crtc_id;
+    uint32_t src_x, src_y, src_w, src_h;
+    uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+    /* optional, 0 if the driver takes no damage hints */
+    uint32_t fb_damage_clips;
+  } plane;
+  /* written by the kernel on commit, see OUT_FENCE_PTR; signals when the
+   * commit in flight completed, -1 if there is none */
+  int32_t out_fence;
+};
+
+extern const struct drm_backend drm_atomic_backend;
+
+int drm_atomic_setup_dev(struct drm_manager *drm, struct drm_dev *dev);
+int drm_atomic_test(struct drm_dev *dev);
+void drm_atomic_free(struct drm_dev *dev);
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,7 +15,49 @@ typedef struct conn_list {
   drmModeConnector *conn;
 } conn_list;
 
+/* half-open pixel rectangle [x0, x1) x [y0, y1), empty if x0 >= x1 */
+struct drm_rect {
+  int32_t x0, y0, x1, y1;
+};
+
+static inline bool drm_rect_empty(const struct drm_rect *r) {
+  return r->x0 >= r->x1 || r->y0 >= r->y1;
+}
+
+/* grow r to also cover o */
+static inline void drm_rect_union(struct drm_rect *r, const struct drm_rect *o) {
+  if (drm_rect_empty(o))
+    return;
+  if (drm_rect_empty(r)) {
+    *r = *o;
+    return;
+  }
+  if (o->x0 < r->x0)
+    r->x0 = o->x0;
+  if (o->y0 < r->y0)
+    r->y0 = o->y0;
+  if (o->x1 > r->x1)
+    r->x1 = o->x1;
+  if (o->y1 > r->y1)
+    r->y1 = o->y1;
+}
+
+/* most buffers a swapchain can have */
+#define DRM_MAX_BUFS 4
+
+/* Life cycle of a swapchain buffer: acquired for drawing, presented, which
+ * queues it behind a flip still in flight or flips to it right away, shown,
+ * and released back to free once the next buffer replaced it on screen. */
+enum drm_buf_state {
+  DRM_BUF_FREE,
+  DRM_BUF_ACQUIRED,
+  DRM_BUF_QUEUED,
+  DRM_BUF_FLIPPING,
+  DRM_BUF_SCANOUT,
+};
+
 struct drm_buf {
+  enum drm_buf_state state;
   uint32_t fb_id;
   uint32_t width;
   uint32_t height;
@@ -21,18 +66,96 @@ struct drm_buf {
   uint32_t pitch;
   uint32_t handle;
   uint8_t *map;
+  /* what the frame this buffer held last drew, background elsewhere */
+  struct drm_rect damage;
+  /* where the frame in it differs from the one presented before */
+  struct drm_rect changed;
+  /* telemetry of the frame it holds: drawing time, when it was presented */
+  uint64_t render_ns;
+  uint64_t submit_ns;
 };
 
+struct drm_dev;
+struct drm_atomic;
+struct pixel_format;
+struct telemetry;
+struct capture;
+struct raster_bins;
+struct worker_pool;
+
+/* A backend decides where the buffers of a drm_dev live and how a finished
+ * back buffer gets presented. The KMS backend scans out dumb buffers, the
+ * headless backend only keeps them in memory. */
+struct drm_backend {
+  const char *name;
+  /* buffers are normal cached memory rather than a write-combined mapping */
+  bool cached;
+  /* initial modeset showing the front buffer, may be NULL */
+  int (*modeset)(struct drm_dev *dev);
+  /* start a flip to buf, no other flip is in flight */
+  int (*flip)(struct drm_dev *dev, struct drm_buf *buf);
+  /* wait up to timeout_ms for the flip in flight to complete, -ETIMEDOUT if
+   * it did not; NULL if flips complete at once */
+  int (*wait)(struct drm_dev *dev, int timeout_ms);
+  void (*destroy)(struct drm_dev *dev);
+};
+
+extern const struct drm_backend drm_kms_backend;
+
 struct drm_dev {
+  const struct drm_backend *backend;
   int fd;
   uint32_t conn_id;
   uint32_t enc_id;
   uint32_t crtc_id;
 
   drmModeModeInfo mode;
+  /* layout of the pixels in all buffers, and in the shadow */
+  const struct pixel_format *format;
+  /* swapchain of nbufs buffers, 2 to DRM_MAX_BUFS */
+  unsigned int nbufs;
+  struct drm_buf bufs[DRM_MAX_BUFS];
+  /* buffer on screen */
   uint32_t front_buf;
-  struct drm_buf bufs[2];
+  /* buffer drawing goes to, only while it is acquired */
+  uint32_t back_buf;
+  /* buffer a flip is in flight to, -1 if none */
+  int flip_buf;
+  /* presented buffers waiting for flip_buf to complete, oldest first */
+  uint8_t queue[DRM_MAX_BUFS];
+  unsigned int queued;
+  /* a page flip was queued and its completion event not seen yet */
+  atomic_bool flip_pending;
+  /* CLOCK_MONOTONIC time the last completed flip hit the screen, set by
+   * the backend before it reports the flip done */
+  uint64_t flip_ns;
+  /* serialises reading events from fd between threads, NULL if the device
+   * never waits for events */
+  pthread_mutex_t *event_lock;
   drmModeCrtc *saved_crtc;
+  /* the CRTC already shows mode on this connector, so drm_modeset only
+   * needs to swap in the front buffer */
+  bool mode_active;
+  /* cached system memory copy of the frame that drawing goes to instead of
+   * the back buffer, NULL to draw into the mapped buffer directly */
+  uint8_t *shadow;
+  /* region drawn into since the last clear */
+  struct drm_rect dirty;
+  /* dirty of the frame presented last */
+  struct drm_rect presented;
+  /* scratch for sorting batches of lines, allocated on first use */
+  struct raster_bins *bins;
+  /* threads rasterising into this device, NULL for the calling one only;
+   * not owned by the device */
+  struct worker_pool *pool;
+  /* how long drawing the current frame took, see flip_buffer */
+  uint64_t render_ns;
+  /* per frame timings, NULL to not record any */
+  struct telemetry *tm;
+  /* records every presented frame, NULL if not recording; not owned */
+  struct capture *capture;
+  /* atomic backend state, NULL on the legacy path */
+  struct drm_atomic *atomic;
 };
 
 typedef struct drm_dev_list {
@@ -48,18 +171,32 @@ struct drm_manager {
   drmModeConnector *activeConn;
   int dri_fd;
   drmModeRes *res;
-};
-
-struct connector {
-  uint32_t id;
-  char mode_str[64];
-  drmModeModeInfo *mode;
-  drmModeEncoder *encoder;
-  int crtc;
-  unsigned int fb_id[2], current_fb_id;
-  struct timeval start;
-
-  int swap_count;
+  /* encoders and CRTCs of res, in the same order as res->encoders and
+   * res->crtcs, fetched once by registerConnectors; NULL if it failed */
+  drmModeEncoder **encs;
+  drmModeCrtc **crtcs;
+  /* set before registerConnectors to take the connector state the kernel
+   * has instead of probing every output, and to keep the mode a monitor
+   * shows already when there is no mode_spec */
+  bool fast_start;
+  /* set before drm_open to stay on the legacy KMS API */
+  bool force_legacy;
+  /* DRM_CLIENT_CAP_ATOMIC was granted by the driver */
+  bool atomic;
+  /* which mode to pick per connector, see mode_pick; NULL for the first */
+  const char *mode_spec;
+  /* estimated time to render a frame at a resolution, for mode_spec "auto" */
+  uint64_t (*render_cost)(struct drm_manager *drm, uint32_t width,
+                          uint32_t height, void *arg);
+  void *render_cost_arg;
+  /* render at 1/scale of the mode size and have the primary plane scale
+   * the buffers up, 1 for native; falls back to 1 if the plane cannot */
+  unsigned int scale;
+  /* swapchain depth and pixel format of the devices set up from now on */
+  unsigned int nbufs;
+  const struct pixel_format *format;
+  /* shared by all devices on dri_fd, see drm_dev.event_lock */
+  pthread_mutex_t event_lock;
 };
 
 void drm_manager_init(struct drm_manager *drm);
@@ -72,5 +209,16 @@ int drm_setup_dev(struct drm_manager *drm, struct drm_dev *dev,
 int drm_open(struct drm_manager *drm, const char *node);
 int drm_prepare(struct drm_manager *drm);
 void drm_cleanup(struct drm_manager *drm);
-void connector_find_mode(struct drm_manager *drm, struct connector *c);
+void drm_dev_teardown(struct drm_dev *dev);
+int drm_modeset(struct drm_dev *dev);
+void drm_swap_init(struct drm_dev *dev);
+int drm_wait_flip(struct drm_dev *dev, int timeout_ms);
 int flip_buffer(struct drm_dev *dev);
+int wait_buffer(struct drm_dev *dev);
+int drm_handle_events(int fd, int timeout_ms);
+uint64_t drm_refresh_ns(const struct drm_dev *dev);
+
+/* the buffer drawing goes to, see wait_buffer */
+static inline struct drm_buf *drm_back_buf(struct drm_dev *dev) {
+  return &dev->bufs[dev->back_buf];
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "draw.h"
+
+/* Memory layout of a pixel: cpp bytes, little endian, no padding between
+ * pixels of a row. pack turns a color into the pixel value, once per draw
+ * call rather than per pixel; unpack goes back, for reading frames out. */
+struct pixel_format {
+  const char *name;
+  /* DRM_FORMAT_* code for drmModeAddFB2 */
+  uint32_t fourcc;
+  uint32_t cpp;
+  uint32_t (*pack)(color c);
+  color (*unpack)(uint32_t pixel);
+};
+
+extern const struct pixel_format format_xrgb8888;
+extern const struct pixel_format format_rgb565;
+extern const struct pixel_format format_xrgb2101010;
+
+const struct pixel_format *format_find(const char *name);
+
+/* the 4-byte pattern the fill kernels repeat to write pixel */
+static inline uint32_t format_pattern(const struct pixel_format *f,
+                                      uint32_t pixel) {
+  return f->cpp == 2 ? pixel | pixel << 16 : pixel;
+}
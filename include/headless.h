@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "drm_helper.h"
+
+extern const struct drm_backend headless_backend;
+
+int headless_setup_dev(struct drm_dev *dev, uint32_t width, uint32_t height,
+                       const struct pixel_format *format, unsigned int nbufs,
+                       bool hugepages);
+int headless_register(struct drm_manager *drm, uint32_t width, uint32_t height,
+                      bool hugepages);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drm_helper.h"
+
+struct dlist;
+struct dlist_writer;
+
+struct heads_config {
+  /* every head renders on a thread of its own, otherwise the heads take
+   * turns on the calling thread */
+  bool threaded;
+  /* rasteriser threads per head when threaded, in total otherwise */
+  unsigned int threads;
+  size_t max_points;
+  /* adapt the point count of every head, starting at max_points, to render
+   * a frame in this time; 0 for a fixed count, see tt_anim_govern */
+  uint64_t budget_ns;
+  /* play this display list on every head instead of computing frames */
+  const struct dlist *play;
+  /* record the frames of the first head, NULL if not */
+  struct dlist_writer *record;
+  /* draw a grid of this many small timetables on every head instead of
+   * one, each of up to max_points points; 0 for one, see tt_wall_init.
+   * Not for use with budget_ns, play or record. */
+  unsigned int wall_cols, wall_rows;
+};
+
+/* Animate a timetable on every device of drm at the same time. Frames are
+ * rendered for all heads before any of them is flipped, so the flips of one
+ * frame go out together. */
+int heads_run(struct drm_manager *drm, const struct heads_config *cfg);
+
+/* points on the circle of every head's timetable */
+#define HEADS_POINTS 200
+
+uint64_t heads_render_cost(struct drm_manager *drm, uint32_t width,
+                           uint32_t height, void *arg);
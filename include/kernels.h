@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Row kernels for filling and copying pixel memory. There is one set per
+ * instruction set, kernels() returns the best one the CPU supports.
+ * "stream" asks for non-temporal stores, which is what write-combined
+ * dumb buffer mappings want; cached memory that is read again soon
+ * should not use them. */
+struct pixel_kernels {
+  const char *name;
+  /* write len bytes of each of h rows, repeating the 4-byte pattern from
+   * dst on; len need not be a multiple of 4 */
+  void (*fill)(uint8_t *dst, size_t stride, size_t len, size_t h,
+               uint32_t pattern, bool stream);
+  /* copy len bytes of each of h rows */
+  void (*copy)(uint8_t *dst, size_t dst_stride, const uint8_t *src,
+               size_t src_stride, size_t len, size_t h, bool stream);
+};
+
+const struct pixel_kernels *kernels(void);
+int kernels_select(const char *name);
+size_t kernels_available(const struct pixel_kernels **list, size_t max);
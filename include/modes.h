@@ -0,0 +1,12 @@
+#pragma once
+
+#include "drm_helper.h"
+
+/* Share of a refresh period the renderer may use in "auto" mode selection,
+ * the rest is headroom for uploads, scanout contention and spikes */
+#define MODE_BUDGET_PERCENT 75
+
+uint64_t mode_period_ns(const drmModeModeInfo *m);
+bool mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b);
+int mode_pick(struct drm_manager *drm, const drmModeConnector *conn,
+              drmModeModeInfo *mode);
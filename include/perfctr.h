@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* The stages of a frame that hardware counters are attributed to */
+enum perf_stage {
+  /* chord walk and sorting the chords into bands */
+  PERF_SETUP,
+  PERF_CLEAR,
+  PERF_ELLIPSE,
+  PERF_LINES,
+  /* flip_buffer, including the shadow upload */
+  PERF_FLIP,
+  PERF_STAGES
+};
+
+/* set by perfctr_enable, instrumentation is a no-op while false */
+extern bool perfctr_enabled;
+
+int perfctr_enable(void);
+void perfctr_report(FILE *out);
+void perfctr_snapshot(void);
+void perfctr_account(enum perf_stage stage);
+
+/* Start counting on the calling thread; what it does until the next
+ * perfctr_mark is attributed to the stage passed there. */
+static inline void perfctr_begin(void) {
+  if (perfctr_enabled)
+    perfctr_snapshot();
+}
+
+static inline void perfctr_mark(enum perf_stage stage) {
+  if (perfctr_enabled)
+    perfctr_account(stage);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "draw.h"
+
+/* Memory the rasteriser writes into, and the part of it it may touch.
+ * Pixels outside of clip are never written. Pixels are cpp bytes, 2 or 4,
+ * and written as the low cpp bytes of the pixel value. */
+struct raster_target {
+  uint8_t *map;
+  uint32_t stride;
+  uint32_t cpp;
+  struct drm_rect clip;
+};
+
+/* Lines with an end point further out than this on either axis are not
+ * drawn at all. It keeps the 64-bit clipping maths exact; drawing never gets
+ * anywhere near it. */
+#define RASTER_COORD_MAX (1 << 29)
+
+static inline bool raster_coord_ok(vec2 p) {
+  return p.x >= -RASTER_COORD_MAX && p.x <= RASTER_COORD_MAX &&
+         p.y >= -RASTER_COORD_MAX && p.y <= RASTER_COORD_MAX;
+}
+
+/* Ellipses with a negative radius, one above this or a centre beyond
+ * RASTER_COORD_MAX are not drawn either. The error terms of the ellipse walk
+ * grow with the cube of the radius and have to stay within 64 bits. */
+#define RASTER_RADIUS_MAX (1 << 20)
+
+static inline bool raster_ellipse_ok(vec2 c, int a, int b) {
+  return a >= 0 && a <= RASTER_RADIUS_MAX && b >= 0 &&
+         b <= RASTER_RADIUS_MAX && raster_coord_ok(c);
+}
+
+void raster_point(const struct raster_target *t, int x, int y, uint32_t pixel);
+void raster_line(const struct raster_target *t, vec2 p0, vec2 p1,
+                 uint32_t pixel);
+void raster_ellipse(const struct raster_target *t, vec2 c, int a, int b,
+                    uint32_t pixel);
+void raster_fill_ellipse(const struct raster_target *t, vec2 c, int a, int b,
+                         uint32_t pixel);
+
+/* Segment indices sorted into horizontal bands of band_rows rows each, so a
+ * batch of lines can be rasterised band by band. Kept across frames to
+ * avoid reallocating. */
+struct raster_bins {
+  uint32_t band_rows;
+  uint32_t nbands;
+  /* segments of band b are idx[start[b]] .. idx[start[b + 1] - 1] */
+  uint32_t *start;
+  uint32_t *idx;
+  size_t cap_bands;
+  size_t cap_idx;
+};
+
+int raster_bin_segments(struct raster_bins *b, const struct raster_target *t,
+                        const segment *segs, size_t n, uint32_t band_rows);
+void raster_band_lines(const struct raster_target *t,
+                       const struct raster_bins *b, uint32_t band,
+                       const segment *segs, uint32_t pixel);
+void raster_bins_free(struct raster_bins *b);
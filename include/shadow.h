@@ -0,0 +1,9 @@
+#pragma once
+
+#include "drm_helper.h"
+
+int shadow_enable(struct drm_dev *dev);
+void shadow_disable(struct drm_dev *dev);
+void shadow_upload(struct drm_dev *dev);
+void shadow_copy_rect(uint8_t *dst, const uint8_t *src, uint32_t stride,
+                      uint32_t cpp, const struct drm_rect *r);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* One presented frame, times are CLOCK_MONOTONIC nanoseconds */
+struct tm_frame {
+  /* time spent drawing it */
+  uint64_t render_ns;
+  /* handed to flip_buffer */
+  uint64_t submit;
+  /* shown on screen */
+  uint64_t flip;
+  /* refresh cycles that passed without a new frame before this one */
+  uint32_t missed;
+};
+
+struct telemetry;
+
+struct telemetry *telemetry_create(unsigned int capacity, uint64_t period_ns);
+void telemetry_free(struct telemetry *tm);
+void telemetry_push(struct telemetry *tm, uint64_t render_ns, uint64_t submit,
+                    uint64_t flip);
+size_t telemetry_read(const struct telemetry *tm, uint64_t from,
+                      struct tm_frame *out, size_t max, uint64_t *first);
+void telemetry_report(const struct telemetry *tm, const char *name);
+int telemetry_dump_csv(const struct telemetry *tm, FILE *f, const char *name,
+                       bool header);
@@ -1,12 +1,16 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdio.h>
 
-#define LINE_DEBUG(MSG) printf("%s:%d : %s\n", __func__, __LINE__, MSG);
-#define LOG(...) fprintf(stdout, __VA_ARGS__)
+/* Messages go to stderr, stdout is kept for data: -c - writes the video
+ * there and drm_bench its records. */
+#define LINE_DEBUG(MSG) fprintf(stderr, "%s:%d : %s\n", __func__, __LINE__, MSG);
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
 #define ERROR(...) fprintf(stderr, __VA_ARGS__)
 
 void fatal(char *str);
 void error(char *str);
 int eopen(const char *path, int flag);
 void *emmap(int addr, size_t len, int prot, int flag, int fd, off_t offset);
+uint64_t now_ns(void);
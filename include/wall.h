@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "draw.h"
+
+struct pixel_format;
+
+/* A video wall: cols x rows timetables in a grid over one buffer, every one
+ * with a centre, radius, point count, pace and colour walk of its own. They
+ * wrap around at the end of their range instead of stopping, the wall as a
+ * whole runs as many frames as a single animation does. */
+struct tt_wall {
+  unsigned int cols, rows;
+  /* the grid, centred in the buffer, and the size of a cell in it */
+  struct drm_rect area;
+  int cell_w, cell_h;
+  /* cols * rows animations, row by row */
+  struct tt_anim *cells;
+  size_t frames;
+  size_t max_frames;
+  /* pixel format of the frame being drawn */
+  const struct pixel_format *format;
+};
+
+int tt_wall_init(struct tt_wall *w, uint32_t width, uint32_t height,
+                 unsigned int cols, unsigned int rows, size_t max_points,
+                 uint32_t seed);
+bool tt_wall_frame(struct tt_wall *w, struct drm_dev *dev);
+size_t tt_wall_points(const struct tt_wall *w);
+void tt_wall_free(struct tt_wall *w);
@@ -0,0 +1,13 @@
+#pragma once
+
+/* A fixed pool of threads running index-parallel jobs. The calling thread
+ * takes part in every job, so a pool of n threads uses n - 1 helpers. */
+struct worker_pool;
+
+typedef void (*worker_fn)(void *arg, unsigned int i);
+
+struct worker_pool *worker_pool_create(unsigned int threads);
+void worker_pool_destroy(struct worker_pool *pool);
+unsigned int worker_pool_threads(const struct worker_pool *pool);
+void worker_pool_run(struct worker_pool *pool, worker_fn fn, void *arg,
+                     unsigned int n);
@@ -14,8 +14,16 @@
 
 #include <math.h>
 
+#include <capture.h>
+#include <dlist.h>
 #include <draw.h>
+#include <format.h>
 #include <drm_helper.h>
+#include <headless.h>
+#include <heads.h>
+#include <perfctr.h>
+#include <shadow.h>
+#include <telemetry.h>
 #include <utils.h>
 
 int find_valid_card(struct drm_manager *drm) {
@@ -33,18 +41,211 @@ int find_valid_card(struct drm_manager *drm) {
   return EXIT_FAILURE;
 }
 
+/* largest -S, plane scalers rarely go beyond 4x */
+#define MAX_SCALE 4
+/* largest -t, far beyond what a frame can be split into usefully */
+#define MAX_THREADS 256
+
+static void usage(const char *prog) {
+  ERROR("usage: %s [-L] [-q] [-s] [-j] [-m MODE] [-S SCALE] [-b BUFFERS] [-f FORMAT] "
+        "[-t THREADS] [-G MS | -W CxR] [-T CSV] [-C] [-c FILE] "
+        "[-R FILE | -p FILE] "
+        "[-H WIDTHxHEIGHT [-P]] [card]\n"
+        "  -L      use the legacy KMS API even if atomic is supported\n"
+        "  -q      quick start: no output probing, keep the current mode\n"
+        "  -s      draw into a cached shadow buffer, upload changes on flip\n"
+        "  -m MODE display mode: a mode name, WIDTHxHEIGHT[@HZ], or auto for\n"
+        "          the largest one rendered in time (default: native)\n"
+        "  -S N    render at 1/N of the mode size, 1 to %d, and let the\n"
+        "          display controller scale it up (default 1)\n"
+        "  -b N    swapchain of N buffers, 2 to %d (default 2)\n"
+        "  -f FMT  pixel format: xrgb8888 (default), rgb565 or xrgb2101010\n"
+        "  -j      render every connected monitor on a thread of its own\n"
+        "  -t N    rasterise with N threads, 1 to %d (per monitor with -j)\n"
+        "  -G MS   adapt the detail to render a frame in MS milliseconds and\n"
+        "          animate by time instead of by frame\n"
+        "  -W CxR  video wall: C x R small timetables in a grid, each of\n"
+        "          its own size, detail, pace and colours\n"
+        "  -T CSV  write the timings of every frame to CSV\n"
+        "  -C      count cycles, cache and TLB misses per stage of a frame\n"
+        "  -c FILE record the frames of the first monitor to FILE, as y4m if\n"
+        "          it ends in .y4m or is - for stdout, raw pixels otherwise\n"
+        "  -R FILE record the geometry of the first monitor's frames to FILE\n"
+        "  -p FILE play the frames recorded with -R from FILE\n"
+        "  -H WxH  render into an in-memory buffer instead of a DRM card\n"
+        "  -P      back the headless buffers with hugepages\n",
+        prog, MAX_SCALE, DRM_MAX_BUFS, MAX_THREADS);
+}
+
+/* frames the capture writer may fall behind before frames get dropped */
+#define CAPTURE_FRAMES 8
+
+/* frames kept for the CSV dump, the summary covers all of them; one short
+ * of a power of two, so the ring with its spare slot is not twice as big */
+#define TELEMETRY_FRAMES ((1 << 16) - 1)
+
+static void report_telemetry(struct drm_manager *drm, const char *csv_path) {
+  FILE *csv = NULL;
+  bool header = true;
+  char name[32];
+
+  if (csv_path && !(csv = fopen(csv_path, "w")))
+    ERROR("cannot open %s (%d): %m\n", csv_path, errno);
+  for (drm_dev_list *iter = drm->devs; iter; iter = iter->next) {
+    struct drm_dev *dev = iter->dev;
+
+    if (!dev->tm)
+      continue;
+    snprintf(name, sizeof(name), "%s-%u", dev->backend->name, dev->conn_id);
+    telemetry_report(dev->tm, name);
+    if (csv && telemetry_dump_csv(dev->tm, csv, name, header))
+      ERROR("cannot write %s\n", csv_path);
+    header = false;
+  }
+  if (csv)
+    fclose(csv);
+}
+
 int main(int argc, char **argv) {
-  int ret, dri_fd;
-  struct drm_buf *buf;
+  int ret, dri_fd, opt;
   struct drm_manager drm;
+  bool headless = false, hugepages = false, shadow = false, threaded = false;
+  unsigned int width = 0, height = 0, threads = 1;
+  double budget_ms = 0;
+  const char *csv_path = NULL, *capture_path = NULL;
+  const char *record_path = NULL, *play_path = NULL;
+  struct capture *cap = NULL;
+  struct heads_config cfg = {0};
+  struct dlist dl = {0};
 
   drm_manager_init(&drm);
-  if (argc == 1)
+  while ((opt = getopt(argc, argv, "Lqsjm:S:b:f:t:G:W:T:Cc:R:p:H:Ph")) != -1) {
+    switch (opt) {
+    case 'H':
+      if (sscanf(optarg, "%ux%u", &width, &height) != 2 || !width || !height) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      headless = true;
+      break;
+    case 'P':
+      hugepages = true;
+      break;
+    case 'L':
+      drm.force_legacy = true;
+      break;
+    case 'q':
+      drm.fast_start = true;
+      break;
+    case 's':
+      shadow = true;
+      break;
+    case 'm':
+      drm.mode_spec = optarg;
+      break;
+    case 'S':
+      drm.scale = strtoul(optarg, NULL, 0);
+      if (drm.scale < 1 || drm.scale > MAX_SCALE) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'b':
+      drm.nbufs = strtoul(optarg, NULL, 0);
+      if (drm.nbufs < 2 || drm.nbufs > DRM_MAX_BUFS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'G':
+      budget_ms = strtod(optarg, NULL);
+      if (budget_ms <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'W':
+      if (sscanf(optarg, "%ux%u", &cfg.wall_cols, &cfg.wall_rows) != 2 ||
+          !cfg.wall_cols || !cfg.wall_rows) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'T':
+      csv_path = optarg;
+      break;
+    case 'C':
+      perfctr_enable();
+      break;
+    case 'c':
+      capture_path = optarg;
+      break;
+    case 'R':
+      record_path = optarg;
+      break;
+    case 'p':
+      play_path = optarg;
+      break;
+    case 'f':
+      drm.format = format_find(optarg);
+      if (!drm.format) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'j':
+      threaded = true;
+      break;
+    case 't': {
+      unsigned long n = strtoul(optarg, NULL, 0);
+
+      if (n < 1 || n > MAX_THREADS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      threads = n;
+      break;
+    }
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if ((record_path && play_path) ||
+      (cfg.wall_cols && (budget_ms || record_path || play_path))) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (play_path) {
+    ret = dlist_open(&dl, play_path);
+    if (ret) {
+      errno = -ret;
+      ERROR("cannot play display list %s: %m\n", play_path);
+      return EXIT_FAILURE;
+    }
+    cfg.play = &dl;
+  }
+
+  /* calibrate with the threads that will render */
+  drm.render_cost = heads_render_cost;
+  drm.render_cost_arg = &threads;
+
+  if (headless)
+    ret = headless_register(&drm, width, height, hugepages);
+  else if (optind == argc)
     find_valid_card(&drm);
   else
-    drm_open(&drm, argv[1]);
+    drm_open(&drm, argv[optind]);
 
   dri_fd = drm.dri_fd;
+  if (headless) {
+    if (ret) {
+      ERROR("failed to set up headless device\n");
+      goto out_close;
+    }
+    goto draw;
+  }
+
   /* prepare all connectors and CRTCs */
   ret = registerConnectors(&drm);
   if (ret) {
@@ -52,32 +253,56 @@ int main(int argc, char **argv) {
     goto out_close;
   }
   /* perform actual modesetting on each found connector+CRTC */
+  for (drm_dev_list *iter = drm.devs; iter; iter = iter->next)
+    drm_modeset(iter->dev);
+
+draw:
   for (drm_dev_list *iter = drm.devs; iter; iter = iter->next) {
-    struct drm_dev *dev = iter->dev;
-    dev->saved_crtc = drmModeGetCrtc(dri_fd, dev->crtc_id);
-    buf = &dev->bufs[dev->front_buf];
-    ret = drmModeSetCrtc(dri_fd, dev->crtc_id, buf->fb_id, 0, 0, &dev->conn_id,
-                         1, &dev->mode);
-    if (ret)
-      fprintf(stderr, "cannot set CRTC for connector %u (%d): %m\n",
-              dev->conn_id, errno);
+    if (shadow && shadow_enable(iter->dev))
+      ERROR("cannot allocate shadow buffer, drawing uncached\n");
+    iter->dev->tm = telemetry_create(TELEMETRY_FRAMES,
+                                     drm_refresh_ns(iter->dev));
   }
 
-  // draw the timetable
-  for (drm_dev_list *iter = drm.devs; iter; iter = iter->next) {
-    struct drm_dev *dev = iter->dev;
-    vec2 cpos;
-    cpos.x = dev->mode.hdisplay / 2;
-    cpos.y = dev->mode.vdisplay / 2;
-    draw_tt(iter->dev, cpos, cpos.y - 10, 200);
+  if (capture_path && drm.devs) {
+    struct drm_dev *dev = drm.devs->dev;
+
+    cap = capture_open(capture_path, dev->bufs[0].width, dev->bufs[0].height,
+                       dev->format, dev->mode.vrefresh, CAPTURE_FRAMES);
+    dev->capture = cap;
+  }
+
+  if (record_path && drm.devs)
+    cfg.record = dlist_create(record_path, drm.devs->dev->bufs[0].width,
+                              drm.devs->dev->bufs[0].height);
+
+  // draw the timetable on all monitors at once
+  cfg.threaded = threaded;
+  cfg.threads = threads;
+  cfg.max_points = HEADS_POINTS;
+  cfg.budget_ns = budget_ms * 1000000;
+  if (heads_run(&drm, &cfg))
+    ERROR("cannot start drawing\n");
+
+  if (cfg.record)
+    dlist_finish(cfg.record);
+
+  if (cap) {
+    drm.devs->dev->capture = NULL;
+    capture_close(cap);
   }
 
+  report_telemetry(&drm, csv_path);
+  perfctr_report(stderr);
+
   /* cleanup everything */
   drm_cleanup(&drm);
 
   ret = 0;
 out_close:
-  close(dri_fd);
+  dlist_close(&dl);
+  if (dri_fd >= 0)
+    close(dri_fd);
   if (ret) {
     errno = -ret;
     fprintf(stderr, "modeset failed with error %d: %m\n", errno);
@@ -0,0 +1,293 @@
+/*
+ * Frame Capture.
+ * Records the presented frames into a file or pipe without holding up the
+ * render loop. The render thread copies each frame into a free slot of a
+ * pool preallocated at open and moves on; a writer thread empties the pool
+ * in batches, one writev per batch. When the writer falls behind and no
+ * slot is free the frame is dropped and counted.
+ *
+ * A path ending in .y4m, and stdout, get a YUV4MPEG2 stream in 4:4:4 BT.601
+ * that any player or encoder understands without being told size and
+ * format; the conversion runs on the writer thread. Any other path gets the
+ * pixels as they are, rows packed without padding.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <capture.h>
+#include <format.h>
+#include <kernels.h>
+#include <utils.h>
+
+/* most frames written with one writev */
+#define CAPTURE_BATCH 8
+
+static const char y4m_frame[] = "FRAME\n";
+
+struct capture {
+  int fd;
+  bool y4m;
+  uint32_t width, height;
+  const struct pixel_format *format;
+  /* bytes of a frame as copied from the buffer, and as written out */
+  size_t raw_size, out_size;
+
+  /* ring of nframes slots, the writer owns filled ones from tail on */
+  unsigned int nframes;
+  uint8_t **raw;
+  /* y4m only: the converted frame of each slot */
+  uint8_t **out;
+  unsigned int head, tail, filled;
+  bool stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t writer;
+
+  /* render thread only */
+  uint64_t dropped;
+  /* writer thread only, read after it joined */
+  uint64_t written;
+  int error;
+};
+
+static inline uint8_t clamp8(int v) { return v < 0 ? 0 : v > 255 ? 255 : v; }
+
+/* planar Y, U, V at full resolution, limited range */
+static void convert_y4m(const struct capture *cap, const uint8_t *src,
+                        uint8_t *dst) {
+  size_t n = (size_t)cap->width * cap->height;
+  uint8_t *y = dst, *u = dst + n, *v = dst + 2 * n;
+  uint32_t cpp = cap->format->cpp;
+
+  for (size_t i = 0; i < n; i++) {
+    uint32_t p;
+    color c;
+
+    if (cpp == 2) {
+      uint16_t p16;
+      memcpy(&p16, src + i * 2, 2);
+      p = p16;
+    } else {
+      memcpy(&p, src + i * 4, 4);
+    }
+    c = cap->format->unpack(p);
+    y[i] = clamp8(((66 * c.r + 129 * c.g + 25 * c.b + 128) >> 8) + 16);
+    u[i] = clamp8(((-38 * c.r - 74 * c.g + 112 * c.b + 128) >> 8) + 128);
+    v[i] = clamp8(((112 * c.r - 94 * c.g - 18 * c.b + 128) >> 8) + 128);
+  }
+}
+
+/* writev all of iov, pipes may take less than asked at a time */
+static int write_all(int fd, struct iovec *iov, int n) {
+  while (n) {
+    ssize_t done = writev(fd, iov, n);
+
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    while (n && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n) {
+      iov->iov_base = (uint8_t *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+static void write_batch(struct capture *cap, unsigned int first,
+                        unsigned int n) {
+  struct iovec iov[2 * CAPTURE_BATCH];
+  int k = 0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    unsigned int slot = (first + i) % cap->nframes;
+
+    if (cap->y4m) {
+      convert_y4m(cap, cap->raw[slot], cap->out[slot]);
+      iov[k++] = (struct iovec){(void *)y4m_frame, sizeof(y4m_frame) - 1};
+      iov[k++] = (struct iovec){cap->out[slot], cap->out_size};
+    } else {
+      iov[k++] = (struct iovec){cap->raw[slot], cap->raw_size};
+    }
+  }
+  cap->error = write_all(cap->fd, iov, k);
+  if (cap->error) {
+    errno = -cap->error;
+    ERROR("cannot write capture (%d): %m\n", errno);
+  } else {
+    cap->written += n;
+  }
+}
+
+static void *capture_writer(void *arg) {
+  struct capture *cap = arg;
+
+  for (;;) {
+    unsigned int n, first;
+
+    pthread_mutex_lock(&cap->lock);
+    while (!cap->filled && !cap->stop)
+      pthread_cond_wait(&cap->cond, &cap->lock);
+    n = cap->filled < CAPTURE_BATCH ? cap->filled : CAPTURE_BATCH;
+    first = cap->tail;
+    pthread_mutex_unlock(&cap->lock);
+    /* stop only once the pool is drained */
+    if (!n)
+      break;
+
+    /* after a write error keep draining so the renderer is not stuck
+     * dropping every frame, but do not try again */
+    if (!cap->error)
+      write_batch(cap, first, n);
+
+    pthread_mutex_lock(&cap->lock);
+    cap->tail = (first + n) % cap->nframes;
+    cap->filled -= n;
+    pthread_mutex_unlock(&cap->lock);
+  }
+  return NULL;
+}
+
+static void capture_free(struct capture *cap) {
+  for (unsigned int i = 0; cap->raw && i < cap->nframes; i++) {
+    free(cap->raw[i]);
+    if (cap->out)
+      free(cap->out[i]);
+  }
+  free(cap->raw);
+  free(cap->out);
+  if (cap->fd > STDOUT_FILENO)
+    close(cap->fd);
+  pthread_mutex_destroy(&cap->lock);
+  pthread_cond_destroy(&cap->cond);
+  free(cap);
+}
+
+/* Start recording frames of width x height to path, "-" for stdout. fps
+ * only goes into the y4m header. frames is the size of the pool. */
+struct capture *capture_open(const char *path, uint32_t width, uint32_t height,
+                             const struct pixel_format *format,
+                             unsigned int fps, unsigned int frames) {
+  struct capture *cap;
+  size_t len = strlen(path);
+  char header[64];
+
+  cap = calloc(1, sizeof(*cap));
+  if (!cap)
+    return NULL;
+  pthread_mutex_init(&cap->lock, NULL);
+  pthread_cond_init(&cap->cond, NULL);
+  cap->width = width;
+  cap->height = height;
+  cap->format = format;
+  cap->y4m = (len > 4 && !strcmp(path + len - 4, ".y4m")) ||
+             !strcmp(path, "-");
+  cap->raw_size = (size_t)width * height * format->cpp;
+  cap->out_size = cap->y4m ? (size_t)width * height * 3 : cap->raw_size;
+
+  cap->fd = strcmp(path, "-")
+                ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                : STDOUT_FILENO;
+  if (cap->fd < 0) {
+    ERROR("cannot open %s (%d): %m\n", path, errno);
+    cap->fd = -1;
+    goto err;
+  }
+
+  cap->nframes = frames;
+  cap->raw = calloc(frames, sizeof(*cap->raw));
+  if (cap->y4m)
+    cap->out = calloc(frames, sizeof(*cap->out));
+  if (!cap->raw || (cap->y4m && !cap->out))
+    goto err_pool;
+  for (unsigned int i = 0; i < frames; i++) {
+    cap->raw[i] = aligned_alloc(64, (cap->raw_size + 63) & ~(size_t)63);
+    if (!cap->raw[i])
+      goto err_pool;
+    /* fault the pages in now rather than inside the first frames */
+    memset(cap->raw[i], 0, cap->raw_size);
+    if (cap->y4m && !(cap->out[i] = malloc(cap->out_size)))
+      goto err_pool;
+  }
+
+  if (cap->y4m) {
+    struct iovec iov;
+
+    iov.iov_base = header;
+    iov.iov_len = snprintf(header, sizeof(header),
+                           "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", width,
+                           height, fps ? fps : 60);
+    if (write_all(cap->fd, &iov, 1)) {
+      ERROR("cannot write %s (%d): %m\n", path, errno);
+      goto err;
+    }
+  }
+
+  if (pthread_create(&cap->writer, NULL, capture_writer, cap)) {
+    ERROR("cannot start capture writer\n");
+    goto err;
+  }
+  return cap;
+
+err_pool:
+  ERROR("cannot allocate %u capture frames\n", frames);
+err:
+  capture_free(cap);
+  return NULL;
+}
+
+/* Queue a copy of the frame in pixels, or drop it if the writer is behind.
+ * Only one thread may call this. */
+void capture_frame(struct capture *cap, const uint8_t *pixels,
+                   uint32_t stride) {
+  unsigned int slot;
+
+  pthread_mutex_lock(&cap->lock);
+  slot = cap->filled < cap->nframes ? cap->head : UINT_MAX;
+  pthread_mutex_unlock(&cap->lock);
+  if (slot == UINT_MAX) {
+    cap->dropped++;
+    return;
+  }
+
+  /* the writer does not touch the slot until filled counts it. It reads
+   * the copy right away, so the copy goes through the cache. */
+  kernels()->copy(cap->raw[slot], (size_t)cap->width * cap->format->cpp,
+                  pixels, stride, (size_t)cap->width * cap->format->cpp,
+                  cap->height, false);
+
+  pthread_mutex_lock(&cap->lock);
+  cap->head = (slot + 1) % cap->nframes;
+  cap->filled++;
+  pthread_cond_signal(&cap->cond);
+  pthread_mutex_unlock(&cap->lock);
+}
+
+/* Write out the frames still queued, report and free */
+void capture_close(struct capture *cap) {
+  if (!cap)
+    return;
+  pthread_mutex_lock(&cap->lock);
+  cap->stop = true;
+  pthread_cond_signal(&cap->cond);
+  pthread_mutex_unlock(&cap->lock);
+  pthread_join(cap->writer, NULL);
+
+  LOG("capture: %llu frames written, %llu dropped\n",
+      (unsigned long long)cap->written, (unsigned long long)cap->dropped);
+  capture_free(cap);
+}
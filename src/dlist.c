@@ -0,0 +1,193 @@
+/*
+ * Display Lists.
+ * Every frame of a timetable is a function of the step, the point count,
+ * centre, radius and colour, but computing it takes trig for the circle and
+ * a walk over all chords. A display list stores the outcome instead: per
+ * frame the colour, the circle and the chord end points. Recording appends
+ * a record per frame through a buffered stream. Playback maps the file and
+ * hands the segments of each record to the rasteriser in place, so it does
+ * no maths and no allocation per frame, and every run draws the same
+ * frames.
+ *
+ * That is a trade of size for zero copy: a chord is stored as the 16 bytes
+ * of a segment, not as two indices into the circle points, so a full run of
+ * 200 chords is about 128 MB. Nothing in a file is trusted, though: records
+ * that do not fit it, and frames with coordinates or radii the rasteriser
+ * does not draw, end playback.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <dlist.h>
+#include <raster.h>
+#include <utils.h>
+
+/* stdio buffer of the writer, holds a few hundred frames of 200 chords */
+#define DLIST_WRITE_BUF (1 << 20)
+
+struct dlist_writer {
+  FILE *f;
+  char *buf;
+  struct dlist_header hdr;
+  int error;
+};
+
+int dlist_open(struct dlist *dl, const char *path) {
+  struct stat st;
+  int fd, ret = 0;
+
+  memset(dl, 0, sizeof(*dl));
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+  if (fstat(fd, &st)) {
+    ret = -errno;
+    goto out;
+  }
+  if ((size_t)st.st_size < sizeof(struct dlist_header)) {
+    ret = -EINVAL;
+    goto out;
+  }
+  dl->len = st.st_size;
+  dl->map = mmap(NULL, dl->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (dl->map == MAP_FAILED) {
+    ret = -errno;
+    dl->map = NULL;
+    goto out;
+  }
+  /* frames are read front to back exactly once per playback */
+  madvise(dl->map, dl->len, MADV_SEQUENTIAL);
+  dl->hdr = (const struct dlist_header *)dl->map;
+  if (dl->hdr->magic != DLIST_MAGIC || dl->hdr->version != DLIST_VERSION ||
+      dl->hdr->size > dl->len - sizeof(*dl->hdr)) {
+    dlist_close(dl);
+    ret = -EINVAL;
+    goto out;
+  }
+  /* a recording that never got to dlist_finish plays as far as its records
+   * made it to the file */
+  dl->size = dl->hdr->size ? dl->hdr->size : dl->len - sizeof(*dl->hdr);
+
+out:
+  close(fd);
+  return ret;
+}
+
+void dlist_close(struct dlist *dl) {
+  if (dl->map)
+    munmap(dl->map, dl->len);
+  memset(dl, 0, sizeof(*dl));
+}
+
+/* Whether the rasteriser takes every coordinate and radius of f as is */
+static bool frame_ok(const struct dlist_frame *f) {
+  const segment *segs = dlist_segs(f);
+
+  if (!raster_ellipse_ok(f->c, f->a, f->b))
+    return false;
+  for (uint32_t i = 0; i < f->nsegs; i++)
+    if (!raster_coord_ok(segs[i].p0) || !raster_coord_ok(segs[i].p1))
+      return false;
+  return true;
+}
+
+/* The frame after f, or the first one if f is NULL. NULL past the last
+ * frame, and also at a record that does not fit the file or holds
+ * geometry out of range, so a recording that was cut short plays up to its
+ * last complete frame and a damaged one up to its last sane frame. */
+const struct dlist_frame *dlist_next(const struct dlist *dl,
+                                     const struct dlist_frame *f) {
+  const uint8_t *end = dl->map + sizeof(*dl->hdr) + dl->size;
+  const uint8_t *p;
+
+  p = f ? (const uint8_t *)f + f->size : dl->map + sizeof(*dl->hdr);
+  if ((size_t)(end - p) < sizeof(*f))
+    return NULL;
+  f = (const struct dlist_frame *)p;
+  if (f->size % 4 || f->size < sizeof(*f) || f->size > (size_t)(end - p) ||
+      (f->size - sizeof(*f)) / sizeof(segment) < f->nsegs || !frame_ok(f))
+    return NULL;
+  return f;
+}
+
+/* Start recording into path, truncating it. The header is only complete
+ * once dlist_finish wrote it. */
+struct dlist_writer *dlist_create(const char *path, uint32_t width,
+                                  uint32_t height) {
+  struct dlist_writer *w = calloc(1, sizeof(*w));
+
+  if (!w)
+    return NULL;
+  w->buf = malloc(DLIST_WRITE_BUF);
+  w->f = fopen(path, "wb");
+  if (!w->buf || !w->f) {
+    ERROR("cannot open display list %s: %m\n", path);
+    if (w->f)
+      fclose(w->f);
+    free(w->buf);
+    free(w);
+    return NULL;
+  }
+  setvbuf(w->f, w->buf, _IOFBF, DLIST_WRITE_BUF);
+  w->hdr.magic = DLIST_MAGIC;
+  w->hdr.version = DLIST_VERSION;
+  w->hdr.width = width;
+  w->hdr.height = height;
+  /* placeholder until the frame count is known */
+  if (fwrite(&w->hdr, sizeof(w->hdr), 1, w->f) != 1)
+    w->error = -EIO;
+  return w;
+}
+
+/* Append a frame: the ellipse with centre center and radii a and b, then
+ * the n segments over it, all in colour c. After an error nothing more is
+ * written and dlist_finish reports it. */
+int dlist_write(struct dlist_writer *w, color c, vec2 center, int a, int b,
+                const segment *segs, size_t n) {
+  struct dlist_frame f = {
+      .size = sizeof(f) + n * sizeof(*segs),
+      .rgb = (c.r & 0xff) << 16 | (c.g & 0xff) << 8 | (c.b & 0xff),
+      .c = center,
+      .a = a,
+      .b = b,
+      .nsegs = n,
+  };
+
+  if (w->error)
+    return w->error;
+  if (fwrite(&f, sizeof(f), 1, w->f) != 1 ||
+      fwrite(segs, sizeof(*segs), n, w->f) != n) {
+    w->error = -EIO;
+    return w->error;
+  }
+  w->hdr.frames++;
+  w->hdr.size += f.size;
+  return 0;
+}
+
+/* Complete the header, close the file and free w */
+int dlist_finish(struct dlist_writer *w) {
+  int ret;
+
+  if (!w->error && (fseek(w->f, 0, SEEK_SET) ||
+                    fwrite(&w->hdr, sizeof(w->hdr), 1, w->f) != 1))
+    w->error = -EIO;
+  if (fclose(w->f) && !w->error)
+    w->error = -EIO;
+  ret = w->error;
+  if (ret)
+    ERROR("display list incomplete, %u frames written\n", w->hdr.frames);
+  else
+    LOG("display list: %u frames, %llu bytes\n", w->hdr.frames,
+        (unsigned long long)(sizeof(w->hdr) + w->hdr.size));
+  free(w->buf);
+  free(w);
+  return ret;
+}
@@ -14,16 +14,32 @@
 
 #include <math.h>
 
+#include <dlist.h>
 #include <draw.h>
+#include <format.h>
+#include <kernels.h>
+#include <perfctr.h>
+#include <raster.h>
+#include <utils.h>
+#include <workers.h>
 
 
+/* 15 random bits from an LCG with the constants of the C standard's
+ * example rand. Each animation has a state of its own, so a seed fixes its
+ * colours no matter what other threads draw. */
+static unsigned int next_rand(uint32_t *state) {
+  *state = *state * 1103515245 + 12345;
+  return (*state >> 16) & 0x7fff;
+}
+
 /* Get a "next" color, that is, visually close to the previous color
  * to ensure a smooth gradually color-change
  */
-static uint8_t next_color(bool *up, uint8_t cur, unsigned int mod) {
+static uint8_t next_color(uint32_t *rng, bool *up, uint8_t cur,
+                          unsigned int mod) {
   uint8_t next;
 
-  next = cur + (*up ? 1 : -1) * (rand() % mod);
+  next = cur + (*up ? 1 : -1) * (next_rand(rng) % mod);
   if ((*up && next < cur) || (!*up && next > cur)) {
     *up = !*up;
     next = cur;
@@ -32,108 +48,605 @@ static uint8_t next_color(bool *up, uint8_t cur, unsigned int mod) {
   return next;
 }
 
+/* Drawing goes to the shadow buffer if there is one, the back buffer else.
+ * Both share the same layout. */
+static inline uint8_t *target_map(struct drm_dev *dev) {
+  return dev->shadow ? dev->shadow : drm_back_buf(dev)->map;
+}
+
+/* Extend the dirty region of the frame by the box spanned by two corners,
+ * clipped to the buffer */
+static void mark_dirty(struct drm_dev *dev, int x0, int y0, int x1, int y1) {
+  struct drm_buf *buf = drm_back_buf(dev);
+  struct drm_rect r;
+
+  r.x0 = x0 < 0 ? 0 : x0;
+  r.y0 = y0 < 0 ? 0 : y0;
+  r.x1 = x1 >= (int)buf->width ? (int)buf->width : x1 + 1;
+  r.y1 = y1 >= (int)buf->height ? (int)buf->height : y1 + 1;
+  drm_rect_union(&dev->dirty, &r);
+}
+
+/* streaming stores only pay off for write-combined mappings */
+static inline bool target_stream(struct drm_dev *dev) {
+  return !dev->shadow && !dev->backend->cached;
+}
+
+static inline uint32_t pack_color(struct drm_dev *dev, color color) {
+  return dev->format->pack(color);
+}
+
+/* the whole buffer as raster target */
+static inline void get_target(struct drm_dev *dev, struct raster_target *t) {
+  struct drm_buf *back = drm_back_buf(dev);
+
+  t->map = target_map(dev);
+  t->stride = back->stride;
+  t->cpp = dev->format->cpp;
+  t->clip.x0 = 0;
+  t->clip.y0 = 0;
+  t->clip.x1 = back->width;
+  t->clip.y1 = back->height;
+}
+
 /* Set pixel at (x,y) coordinate to a given color
  */
 void plot(struct drm_dev *dev, int x, int y, color color) {
-  uint32_t off = dev->bufs[dev->front_buf ^ 1].stride * y + x * 4;
-  *(uint32_t *)&dev->bufs[dev->front_buf ^ 1].map[off] =
-      (color.r << 16) | (color.g << 8) | color.b;
+  struct raster_target t;
+
+  mark_dirty(dev, x, y, x, y);
+  get_target(dev, &t);
+  raster_point(&t, x, y, pack_color(dev, color));
+}
+
+/* The target is background outside of this region: the shadow outside of
+ * what was drawn since the last clear, a back buffer outside of that and
+ * of what the frame it held before drew. */
+static inline struct drm_rect clear_region(struct drm_dev *dev) {
+  struct drm_rect r = dev->dirty;
+
+  if (!dev->shadow)
+    drm_rect_union(&r, &drm_back_buf(dev)->damage);
+  return r;
+}
+
+/* after clearing clear_region, only what gets drawn from now on counts */
+static inline void clear_done(struct drm_dev *dev) {
+  memset(&dev->dirty, 0, sizeof(dev->dirty));
+  if (!dev->shadow)
+    memset(&drm_back_buf(dev)->damage, 0, sizeof(struct drm_rect));
 }
 
 void clear(struct drm_dev *dev) {
-  uint32_t w = dev->bufs[dev->front_buf].width;
-  uint32_t h = dev->bufs[dev->front_buf].height;
+  struct drm_buf *back = drm_back_buf(dev);
+  struct drm_rect r = clear_region(dev);
+  uint32_t cpp = dev->format->cpp;
+
+  if (!drm_rect_empty(&r))
+    kernels()->fill(target_map(dev) + (size_t)r.y0 * back->stride + r.x0 * cpp,
+                    back->stride, (r.x1 - r.x0) * cpp, r.y1 - r.y0, 0,
+                    target_stream(dev));
+  clear_done(dev);
+}
 
-  memset(dev->bufs[dev->front_buf ^ 1].map, 0, w * h * 4);
+/* Fill the w x h rectangle with its top left corner at pos */
+void fill_rect(struct drm_dev *dev, vec2 pos, int w, int h, color col) {
+  struct drm_buf *back = drm_back_buf(dev);
+  uint32_t cpp = dev->format->cpp;
+  int x0 = pos.x < 0 ? 0 : pos.x;
+  int y0 = pos.y < 0 ? 0 : pos.y;
+  int x1 = pos.x + w > (int)back->width ? (int)back->width : pos.x + w;
+  int y1 = pos.y + h > (int)back->height ? (int)back->height : pos.y + h;
+
+  if (x0 >= x1 || y0 >= y1)
+    return;
+  mark_dirty(dev, x0, y0, x1 - 1, y1 - 1);
+  kernels()->fill(target_map(dev) + (size_t)y0 * back->stride + x0 * cpp,
+                  back->stride, (x1 - x0) * cpp, y1 - y0,
+                  format_pattern(dev->format, pack_color(dev, col)),
+                  target_stream(dev));
 }
 
 /* Bresenham Algorithm to draw a rasterized line from one
- * point to another
+ * point to another, see raster_line for the clipped version of it
  */
 void draw_line(struct drm_dev *dev, vec2 p0, vec2 p1, color col) {
-  vec2 d;
-  d.x = abs(p1.x - p0.x);
-  int sx = p0.x < p1.x ? 1 : -1;
-  d.y = -abs(p1.y - p0.y);
-  int sy = p0.y < p1.y ? 1 : -1;
-  int err = d.x + d.y;
-  int e2;
-  while (1) {
-    plot(dev, p0.x, p0.y, col);
-    if (p0.x == p1.x && p0.y == p1.y)
-      break;
-    e2 = 2 * err;
-    if (e2 >= d.y) {
-      err += d.y;
-      p0.x += sx;
-    }
-    if (e2 <= d.x) {
-      err += d.x;
-      p0.y += sy;
-    }
+  struct raster_target t;
+
+  mark_dirty(dev, p0.x < p1.x ? p0.x : p1.x, p0.y < p1.y ? p0.y : p1.y,
+             p0.x < p1.x ? p1.x : p0.x, p0.y < p1.y ? p1.y : p0.y);
+  get_target(dev, &t);
+  raster_line(&t, p0, p1, pack_color(dev, col));
+}
+
+/* Lines of a batch are sorted into bands of about this many bytes, so the
+ * rasteriser stays within a cache- and TLB-friendly part of the buffer */
+#define BAND_BYTES (1 << 20)
+#define BAND_MIN_ROWS 32
+/* with a worker pool, split into at least this many bands per thread so
+ * uneven bands balance out */
+#define BANDS_PER_THREAD 4
+/* below this many lines sorting costs more than it saves */
+#define BATCH_MIN_LINES 64
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+  while (b) {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
   }
+  return a;
 }
 
-/* Bresenham Algorithm to draw an ellipse */
-/* Note: for circle, we could implement a special version which would be
- * more efficient */
-void draw_ellipse(struct drm_dev *dev, vec2 c, int a, int b, color col) {
-  vec2 d;
-  d.x = 0;
-  d.y = b;
-  int64_t a2 = a * a, b2 = b * b;
-  int64_t err = b2 - (2 * b - 1) * a2, e2;
-  do {
-    plot(dev, c.x + d.x, c.y + d.y, col);
-    plot(dev, c.x - d.x, c.y + d.y, col);
-    plot(dev, c.x - d.x, c.y - d.y, col);
-    plot(dev, c.x + d.x, c.y - d.y, col);
-
-    e2 = 2 * err;
-    if (e2 < (2 * d.x + 1) * b2) {
-      d.x++;
-      err += (2 * d.x + 1) * b2;
-    }
-    if (e2 > -(2 * d.y - 1) * a2) {
-      d.y--;
-      err -= (2 * d.y - 1) * a2;
-    }
-  } while (d.y >= 0);
-
-  while (d.x++ < a) {
-    plot(dev, c.x + d.x, c.y, col);
-    plot(dev, c.x - d.x, c.y, col);
+static uint32_t band_rows_for(struct drm_dev *dev, const struct raster_target *t) {
+  uint32_t threads = worker_pool_threads(dev->pool);
+  uint32_t height = t->clip.y1 - t->clip.y0;
+  uint32_t rows = BAND_BYTES / t->stride;
+  uint32_t align;
+
+  if (threads > 1 && rows > height / (BANDS_PER_THREAD * threads))
+    rows = height / (BANDS_PER_THREAD * threads);
+  if (rows < BAND_MIN_ROWS)
+    rows = BAND_MIN_ROWS;
+  /* start every band on a cache line, so no two threads share one */
+  align = 64 / gcd(t->stride, 64);
+  return (rows + align - 1) / align * align;
+}
+
+/* the end of a box reaching to v, no further out than lines are drawn */
+static inline int32_t box_end(int v) {
+  return v < RASTER_COORD_MAX ? v + 1 : RASTER_COORD_MAX + 1;
+}
+
+/* bounding box of a batch of segments */
+static void segs_box(const segment *segs, size_t n, struct drm_rect *box) {
+  memset(box, 0, sizeof(*box));
+  for (size_t i = 0; i < n; i++) {
+    struct drm_rect r = {
+        segs[i].p0.x < segs[i].p1.x ? segs[i].p0.x : segs[i].p1.x,
+        segs[i].p0.y < segs[i].p1.y ? segs[i].p0.y : segs[i].p1.y,
+        box_end(segs[i].p0.x < segs[i].p1.x ? segs[i].p1.x : segs[i].p0.x),
+        box_end(segs[i].p0.y < segs[i].p1.y ? segs[i].p1.y : segs[i].p0.y)};
+    drm_rect_union(box, &r);
   }
 }
 
-void draw_tt(struct drm_dev *dev, vec2 pos, int r, size_t max_points) {
+/* What one band of a batch (or of a whole frame) has to draw. Bands only
+ * write their own rows, so they can run on any thread in any order. */
+struct band_job {
+  struct raster_target t;
+  struct raster_bins *bins;
+  const segment *segs;
+  uint32_t pixel;
+  /* frame jobs clear and draw the ellipse before the lines */
+  bool frame;
+  struct drm_rect clear;
+  bool stream;
+  vec2 pos;
+  int a, b;
+};
+
+static void band_work(void *arg, unsigned int band) {
+  struct band_job *job = arg;
+
+  if (job->frame) {
+    perfctr_begin();
+    struct raster_target bt = job->t;
+    struct drm_rect *c = &bt.clip;
+
+    c->y0 += band * job->bins->band_rows;
+    if (c->y0 + (int32_t)job->bins->band_rows < c->y1)
+      c->y1 = c->y0 + job->bins->band_rows;
+
+    int32_t y0 = job->clear.y0 > c->y0 ? job->clear.y0 : c->y0;
+    int32_t y1 = job->clear.y1 < c->y1 ? job->clear.y1 : c->y1;
+    if (y0 < y1 && !drm_rect_empty(&job->clear))
+      kernels()->fill(bt.map + (size_t)y0 * bt.stride + job->clear.x0 * bt.cpp,
+                      bt.stride, (job->clear.x1 - job->clear.x0) * bt.cpp,
+                      y1 - y0, 0, job->stream);
+    perfctr_mark(PERF_CLEAR);
+    if (job->a)
+      raster_ellipse(&bt, job->pos, job->a, job->b, job->pixel);
+    perfctr_mark(PERF_ELLIPSE);
+  }
+  raster_band_lines(&job->t, job->bins, band, job->segs, job->pixel);
+  if (job->frame)
+    perfctr_mark(PERF_LINES);
+}
+
+/* Sort the job's segments into bands and run them on the device's worker
+ * pool, or on the calling thread without one. Fails only if the bins cannot
+ * be allocated. */
+static int run_bands(struct drm_dev *dev, struct band_job *job, size_t n) {
+  if (!dev->bins)
+    dev->bins = calloc(1, sizeof(*dev->bins));
+  if (!dev->bins ||
+      raster_bin_segments(dev->bins, &job->t, job->segs, n,
+                          band_rows_for(dev, &job->t)))
+    return -ENOMEM;
+  job->bins = dev->bins;
+  if (job->frame)
+    perfctr_mark(PERF_SETUP);
+  worker_pool_run(dev->pool, band_work, job, dev->bins->nbands);
+  return 0;
+}
+
+/* Draw a batch of lines in one color. The order pixels are set in does not
+ * matter then, so the lines are rasterised band by band. */
+void draw_lines(struct drm_dev *dev, const segment *segs, size_t n,
+                color col) {
+  struct band_job job = {0};
+  struct drm_rect box;
+
+  if (!n)
+    return;
+  segs_box(segs, n, &box);
+  mark_dirty(dev, box.x0, box.y0, box.x1 - 1, box.y1 - 1);
+  get_target(dev, &job.t);
+  job.segs = segs;
+  job.pixel = pack_color(dev, col);
+
+  if ((n < BATCH_MIN_LINES && worker_pool_threads(dev->pool) == 1) ||
+      run_bands(dev, &job, n)) {
+    for (size_t i = 0; i < n; i++)
+      raster_line(&job.t, segs[i].p0, segs[i].p1, job.pixel);
+  }
+}
+
+/* Bresenham Algorithm to draw an ellipse, see raster_ellipse */
+void draw_ellipse(struct drm_dev *dev, vec2 c, int a, int b, color col) {
+  struct raster_target t;
+
+  if (!raster_ellipse_ok(c, a, b))
+    return;
+  mark_dirty(dev, c.x - a, c.y - b, c.x + a, c.y + b);
+  get_target(dev, &t);
+  raster_ellipse(&t, c, a, b, pack_color(dev, col));
+}
+
+/* The ellipse draw_ellipse outlines, filled, see raster_fill_ellipse */
+void fill_ellipse(struct drm_dev *dev, vec2 c, int a, int b, color col) {
+  struct raster_target t;
+
+  if (!raster_ellipse_ok(c, a, b))
+    return;
+  mark_dirty(dev, c.x - a, c.y - b, c.x + a, c.y + b);
+  get_target(dev, &t);
+  raster_fill_ellipse(&t, c, a, b, pack_color(dev, col));
+}
+
+void tt_geometry_free(struct tt_geometry *geo) {
+  free(geo->pts);
+  free(geo->segs);
+  geo->pts = NULL;
+  geo->segs = NULL;
+}
+
+/* A coordinate of a circle point. Points further out than lines are drawn
+ * are pinned just beyond that, so any centre and radius stay in int range
+ * and the lines to those points are simply not drawn. */
+static int circle_coord(double v) {
+  if (v > RASTER_COORD_MAX + 1.0)
+    return RASTER_COORD_MAX + 1;
+  if (v < -RASTER_COORD_MAX - 1.0)
+    return -RASTER_COORD_MAX - 1;
+  return v;
+}
 
-  vec2 p1;
-  vec2 p2;
+/* (Re)compute the circle points if centre, radius or count changed */
+int tt_geometry_update(struct tt_geometry *geo, vec2 pos, int r,
+                       size_t max_points) {
   double a = (M_PI * 2) / max_points;
-  double step = 2.0;
-  color c;
-  srand(time(NULL));
-  bool r_up, g_up, b_up;
-  c.r = rand() % 0xff;
-  c.g = rand() % 0xff;
-  c.b = rand() % 0xff;
-  r_up = g_up = b_up = true;
-  while (step <= 200) {
+  segment *segs;
+  vec2 *pts;
+
+  if (geo->pts && geo->pos.x == pos.x && geo->pos.y == pos.y && geo->r == r &&
+      geo->max_points == max_points)
+    return 0;
+
+  pts = realloc(geo->pts, max_points * sizeof(*pts));
+  if (!pts)
+    return -ENOMEM;
+  geo->pts = pts;
+  segs = realloc(geo->segs, max_points * sizeof(*segs));
+  if (!segs) {
+    tt_geometry_free(geo);
+    return -ENOMEM;
+  }
+  geo->segs = segs;
+  for (size_t i = 0; i < max_points; i++) {
+    pts[i].x = circle_coord(pos.x + r * cos(a * i));
+    pts[i].y = circle_coord(pos.y + r * sin(a * i));
+  }
+  geo->pos = pos;
+  geo->r = r;
+  geo->max_points = max_points;
+  return 0;
+}
+
+static void frame(struct drm_dev *dev, vec2 c, int a, int b,
+                  const segment *segs, size_t n, color col) {
+  struct band_job job = {0};
+  struct drm_rect box;
+
+  get_target(dev, &job.t);
+  job.segs = segs;
+  job.pixel = pack_color(dev, col);
+  job.frame = true;
+  job.pos = c;
+  job.a = a;
+  job.b = b;
+  job.clear = clear_region(dev);
+  job.stream = target_stream(dev);
+  if (run_bands(dev, &job, n)) {
     clear(dev);
-    c.r = next_color(&r_up, c.r, 20);
-    c.g = next_color(&g_up, c.g, 10);
-    c.b = next_color(&b_up, c.b, 5);
-    draw_ellipse(dev, pos, r, r, c);
-    for (size_t i = 0; i < max_points; i++) {
-      p1.x = pos.x + r * cos(a * i);
-      p1.y = pos.y + r * sin(a * i);
-
-      p2.x = pos.x + r * cos(a * ((int)(i * step) % max_points));
-      p2.y = pos.y + r * sin(a * ((int)(i * step) % max_points));
-      draw_line(dev, p1, p2, c);
-    }
-    flip_buffer(dev);
-    step += 0.005;
+    if (a)
+      draw_ellipse(dev, c, a, b, col);
+    draw_lines(dev, segs, n, col);
+    return;
+  }
+
+  clear_done(dev);
+  if (n) {
+    segs_box(segs, n, &box);
+    mark_dirty(dev, box.x0, box.y0, box.x1 - 1, box.y1 - 1);
+  }
+  if (a && raster_ellipse_ok(c, a, b))
+    mark_dirty(dev, c.x - a, c.y - b, c.x + a, c.y + b);
+}
+
+/* Draw a whole frame: clear, the ellipse around c with radii a and b
+ * unless a is 0, and n lines over it, all in one colour.
+ * Clearing, the ellipse and the lines are done band by band, which keeps
+ * each band in the cache for all three and lets a worker pool split the
+ * frame. The result is the same as clear + draw_ellipse + draw_lines. */
+void draw_frame(struct drm_dev *dev, vec2 c, int a, int b,
+                const segment *segs, size_t n, color col) {
+  perfctr_begin();
+  frame(dev, c, a, b, segs, n, col);
+}
+
+/* What one strip of a draw_strips frame gets */
+struct strip_job {
+  struct raster_target t;
+  uint32_t rows;
+  struct drm_rect clear;
+  bool stream;
+  strip_fn fn;
+  void *arg;
+};
+
+static void strip_work(void *arg, unsigned int strip) {
+  struct strip_job *job = arg;
+  struct raster_target st = job->t;
+  struct drm_rect *c = &st.clip;
+
+  perfctr_begin();
+  c->y0 += strip * job->rows;
+  if (c->y0 + (int32_t)job->rows < c->y1)
+    c->y1 = c->y0 + job->rows;
+
+  int32_t y0 = job->clear.y0 > c->y0 ? job->clear.y0 : c->y0;
+  int32_t y1 = job->clear.y1 < c->y1 ? job->clear.y1 : c->y1;
+  if (y0 < y1 && !drm_rect_empty(&job->clear))
+    kernels()->fill(st.map + (size_t)y0 * st.stride + job->clear.x0 * st.cpp,
+                    st.stride, (job->clear.x1 - job->clear.x0) * st.cpp,
+                    y1 - y0, 0, job->stream);
+  perfctr_mark(PERF_CLEAR);
+  job->fn(job->arg, &st, strip);
+  perfctr_mark(PERF_LINES);
+}
+
+/* Draw a frame made of many small figures, laid out in horizontal strips of
+ * rows rows each from the top of area. Every strip is cleared and handed to
+ * fn with the target clipped to the strip and to area; fn draws what lies
+ * in it. Strips run on the device's worker pool in any order, so fn must
+ * only touch state of its own strip. The whole area counts as drawn. */
+void draw_strips(struct drm_dev *dev, const struct drm_rect *area,
+                 uint32_t rows, strip_fn fn, void *arg) {
+  struct strip_job job = {0};
+
+  if (drm_rect_empty(area) || !rows)
+    return;
+  get_target(dev, &job.t);
+  job.t.clip = *area;
+  job.rows = rows;
+  job.clear = clear_region(dev);
+  /* anything left above or below the strips is cleared up front */
+  if (!drm_rect_empty(&job.clear) &&
+      (job.clear.y0 < area->y0 || job.clear.y1 > area->y1)) {
+    clear(dev);
+    memset(&job.clear, 0, sizeof(job.clear));
+  }
+  job.stream = target_stream(dev);
+  job.fn = fn;
+  job.arg = arg;
+  worker_pool_run(dev->pool, strip_work, &job,
+                  (area->y1 - area->y0 + rows - 1) / rows);
+  clear_done(dev);
+  mark_dirty(dev, area->x0, area->y0, area->x1 - 1, area->y1 - 1);
+}
+
+/* Compute the lines of one frame into geo->segs: line i connects point i
+ * with point i * step (mod n). The second index is kept as a Q16.16
+ * accumulator modulo n, so the loop needs neither floating point nor a
+ * division. */
+void tt_geometry_chords(struct tt_geometry *geo, uint32_t step) {
+  const vec2 *pts = geo->pts;
+  uint64_t span = (uint64_t)geo->max_points << TT_STEP_SHIFT;
+  uint64_t inc = step % span;
+  uint64_t acc = 0;
+
+  for (size_t i = 0; i < geo->max_points; i++) {
+    geo->segs[i].p0 = pts[i];
+    geo->segs[i].p1 = pts[acc >> TT_STEP_SHIFT];
+    acc += inc;
+    if (acc >= span)
+      acc -= span;
+  }
+}
+
+/* Draw one frame of a timetable, see tt_geometry_chords */
+void draw_tt_frame(struct drm_dev *dev, struct tt_geometry *geo,
+                   uint32_t step, color c) {
+  perfctr_begin();
+  tt_geometry_chords(geo, step);
+  frame(dev, geo->pos, geo->r, geo->r, geo->segs, geo->max_points, c);
+}
+
+int tt_anim_init(struct tt_anim *anim, vec2 pos, int r, size_t max_points) {
+  memset(anim, 0, sizeof(*anim));
+  if (tt_geometry_update(&anim->geo, pos, r, max_points))
+    return -ENOMEM;
+  anim->step = TT_STEP_FIRST;
+  anim->step_inc = TT_STEP_INC;
+  tt_anim_seed(anim, time(NULL));
+  return 0;
+}
+
+/* Restart the colour walk from seed, so the colours of every frame are the
+ * same from run to run */
+void tt_anim_seed(struct tt_anim *anim, uint32_t seed) {
+  anim->rng = seed;
+  anim->c.r = next_rand(&anim->rng) % 0xff;
+  anim->c.g = next_rand(&anim->rng) % 0xff;
+  anim->c.b = next_rand(&anim->rng) % 0xff;
+  anim->r_up = anim->g_up = anim->b_up = true;
+}
+
+/* Move the colour on by one frame */
+void tt_anim_next_color(struct tt_anim *anim) {
+  anim->c.r = next_color(&anim->rng, &anim->r_up, anim->c.r, 20);
+  anim->c.g = next_color(&anim->rng, &anim->g_up, anim->c.g, 10);
+  anim->c.b = next_color(&anim->rng, &anim->b_up, anim->c.b, 5);
+}
+
+void tt_anim_free(struct tt_anim *anim) { tt_geometry_free(&anim->geo); }
+
+/* frames to average over before changing the point count again */
+#define LOD_SETTLE 8
+
+/* Hold render times around budget_ns by drawing as many points as fit, and
+ * advance the animation by time instead of by frame, so it runs equally
+ * fast whatever the frame rate. budget_ns 0 keeps a fixed point count. */
+void tt_anim_govern(struct tt_anim *anim, uint64_t budget_ns) {
+  anim->budget_ns = budget_ns;
+  anim->start_ns = 0;
+  anim->avg_ns = 0;
+  anim->points = anim->geo.max_points;
+  anim->settle = LOD_SETTLE;
+}
+
+/* Pick the point count of the next frames from the render time of this one.
+ * Render time grows about linearly with the number of lines, so the count
+ * is scaled by how far off the budget the average is, aiming a bit below it
+ * and in steps small enough to not overshoot on a noisy measurement. */
+static void lod_update(struct tt_anim *anim, uint64_t render_ns) {
+  uint64_t target = anim->budget_ns * 9 / 10;
+  double scale;
+  size_t points;
+
+  /* moving average over about LOD_SETTLE frames */
+  if (!anim->avg_ns)
+    anim->avg_ns = render_ns;
+  else
+    anim->avg_ns += ((int64_t)render_ns - (int64_t)anim->avg_ns) / LOD_SETTLE;
+  if (--anim->settle)
+    return;
+  anim->settle = LOD_SETTLE;
+  if (anim->avg_ns <= anim->budget_ns && anim->avg_ns >= target * 8 / 10)
+    return;
+
+  scale = anim->avg_ns ? (double)target / anim->avg_ns : 2;
+  if (scale < 0.5)
+    scale = 0.5;
+  if (scale > 1.25)
+    scale = 1.25;
+  points = anim->points * scale;
+  if (points < TT_POINTS_MIN)
+    points = TT_POINTS_MIN;
+  if (points > TT_POINTS_MAX)
+    points = TT_POINTS_MAX;
+  /* expect the new count to cost in proportion */
+  anim->avg_ns = anim->avg_ns * points / anim->points;
+  anim->points = points;
+}
+
+/* Play the frames of dl instead of computing them. dl stays owned by the
+ * caller and may be shared between animations. */
+void tt_anim_play(struct tt_anim *anim, const struct dlist *dl) {
+  anim->play = dl;
+  anim->played = NULL;
+}
+
+/* Append every frame drawn from now on to w, which stays the caller's */
+void tt_anim_record(struct tt_anim *anim, struct dlist_writer *w) {
+  anim->record = w;
+}
+
+static bool tt_anim_replay(struct tt_anim *anim, struct drm_dev *dev) {
+  const struct dlist_frame *f = dlist_next(anim->play, anim->played);
+  uint64_t start;
+
+  if (!f || wait_buffer(dev))
+    return false;
+  start = now_ns();
+  draw_frame(dev, f->c, f->a, f->b, dlist_segs(f), f->nsegs, dlist_color(f));
+  dev->render_ns = now_ns() - start;
+  anim->played = f;
+  anim->frames++;
+  return true;
+}
+
+/* Render the next frame of the animation into the back buffer of dev.
+ * Returns false once the animation is over or the buffer is unusable. */
+bool tt_anim_frame(struct tt_anim *anim, struct drm_dev *dev) {
+  uint64_t start;
+
+  if (anim->play)
+    return tt_anim_replay(anim, dev);
+  if (anim->budget_ns) {
+    if (!anim->start_ns)
+      anim->start_ns = now_ns();
+    anim->step = TT_STEP_FIRST + (now_ns() - anim->start_ns) *
+                                     TT_STEP_PER_SEC / 1000000000ull;
+    if (tt_geometry_update(&anim->geo, anim->geo.pos, anim->geo.r,
+                           anim->points))
+      return false;
+  }
+  if (anim->step > TT_STEP_LAST)
+    return false;
+  tt_anim_next_color(anim);
+  /* the back buffer is still on screen until the last flip completed */
+  if (wait_buffer(dev))
+    return false;
+  start = now_ns();
+  draw_tt_frame(dev, &anim->geo, anim->step, anim->c);
+  dev->render_ns = now_ns() - start;
+  /* a failed write stops the recording, not the animation */
+  if (anim->record && dlist_write(anim->record, anim->c, anim->geo.pos,
+                                  anim->geo.r, anim->geo.r, anim->geo.segs,
+                                  anim->geo.max_points))
+    anim->record = NULL;
+  if (anim->budget_ns)
+    lod_update(anim, dev->render_ns);
+  else
+    anim->step += anim->step_inc;
+  anim->frames++;
+  return true;
+}
+
+size_t draw_tt(struct drm_dev *dev, vec2 pos, int r, size_t max_points) {
+  struct tt_anim anim;
+  size_t frames;
+
+  if (tt_anim_init(&anim, pos, r, max_points))
+    return 0;
+  while (tt_anim_frame(&anim, dev)) {
+    if (flip_buffer(dev))
+      break;
   }
+  frames = anim.frames;
+  tt_anim_free(&anim);
+  return frames;
 }
@@ -0,0 +1,312 @@
+/*
+ * Atomic Modesetting Backend.
+ * Presents buffers with nonblocking atomic commits on the primary plane of
+ * the CRTC. Each commit hands back an out-fence which signals once the new
+ * buffer is on screen, i.e. once the previous one is released. Drivers
+ * without OUT_FENCE_PTR get a page flip event instead. Drivers that take
+ * FB_DAMAGE_CLIPS learn which part of the frame changed, which saves
+ * uploads on USB and SPI displays and virtual ones.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <linux/sync_file.h>
+
+#include <drm_atomic.h>
+#include <utils.h>
+
+#define FENCE_TIMEOUT_MS 1000
+
+static uint32_t find_prop(int fd, uint32_t obj_id, uint32_t obj_type,
+                          const char *name, uint64_t *value) {
+  drmModeObjectProperties *props;
+  uint32_t id = 0;
+
+  props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+  if (!props)
+    return 0;
+
+  for (uint32_t i = 0; i < props->count_props && !id; i++) {
+    drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+    if (!prop)
+      continue;
+    if (!strcmp(prop->name, name)) {
+      id = prop->prop_id;
+      if (value)
+        *value = props->prop_values[i];
+    }
+    drmModeFreeProperty(prop);
+  }
+  drmModeFreeObjectProperties(props);
+  return id;
+}
+
+/* find the primary plane that can be used with the CRTC at crtc_index */
+static uint32_t find_primary_plane(int fd, uint32_t crtc_index) {
+  drmModePlaneRes *planes;
+  uint32_t plane_id = 0;
+
+  planes = drmModeGetPlaneResources(fd);
+  if (!planes)
+    return 0;
+
+  for (uint32_t i = 0; i < planes->count_planes && !plane_id; i++) {
+    drmModePlane *plane = drmModeGetPlane(fd, planes->planes[i]);
+    uint64_t type;
+
+    if (!plane)
+      continue;
+    if ((plane->possible_crtcs & (1u << crtc_index)) &&
+        find_prop(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) &&
+        type == DRM_PLANE_TYPE_PRIMARY)
+      plane_id = plane->plane_id;
+    drmModeFreePlane(plane);
+  }
+  drmModeFreePlaneResources(planes);
+  return plane_id;
+}
+
+int drm_atomic_setup_dev(struct drm_manager *drm, struct drm_dev *dev) {
+  struct drm_atomic *a;
+  int fd = dev->fd;
+  int i;
+
+  a = calloc(1, sizeof(*a));
+  if (!a)
+    return -ENOMEM;
+  a->out_fence = -1;
+
+  for (i = 0; i < drm->res->count_crtcs; i++)
+    if (drm->res->crtcs[i] == dev->crtc_id)
+      break;
+  if (i == drm->res->count_crtcs)
+    goto err;
+  a->crtc_index = i;
+
+  a->plane_id = find_primary_plane(fd, a->crtc_index);
+  if (!a->plane_id) {
+    fprintf(stderr, "no primary plane for CRTC %u\n", dev->crtc_id);
+    goto err;
+  }
+
+#define CRTC_PROP(name) find_prop(fd, dev->crtc_id, DRM_MODE_OBJECT_CRTC, name, NULL)
+#define PLANE_PROP(name) find_prop(fd, a->plane_id, DRM_MODE_OBJECT_PLANE, name, NULL)
+  a->crtc.active = CRTC_PROP("ACTIVE");
+  a->crtc.mode_id = CRTC_PROP("MODE_ID");
+  a->crtc.out_fence_ptr = CRTC_PROP("OUT_FENCE_PTR");
+  a->conn.crtc_id = find_prop(fd, dev->conn_id, DRM_MODE_OBJECT_CONNECTOR,
+                              "CRTC_ID", NULL);
+  a->plane.fb_id = PLANE_PROP("FB_ID");
+  a->plane.crtc_id = PLANE_PROP("CRTC_ID");
+  a->plane.src_x = PLANE_PROP("SRC_X");
+  a->plane.src_y = PLANE_PROP("SRC_Y");
+  a->plane.src_w = PLANE_PROP("SRC_W");
+  a->plane.src_h = PLANE_PROP("SRC_H");
+  a->plane.crtc_x = PLANE_PROP("CRTC_X");
+  a->plane.crtc_y = PLANE_PROP("CRTC_Y");
+  a->plane.crtc_w = PLANE_PROP("CRTC_W");
+  a->plane.crtc_h = PLANE_PROP("CRTC_H");
+  a->plane.fb_damage_clips = PLANE_PROP("FB_DAMAGE_CLIPS");
+#undef CRTC_PROP
+#undef PLANE_PROP
+
+  /* OUT_FENCE_PTR and FB_DAMAGE_CLIPS are optional, everything else is
+   * mandatory */
+  if (!a->crtc.active || !a->crtc.mode_id || !a->conn.crtc_id ||
+      !a->plane.fb_id || !a->plane.crtc_id || !a->plane.src_x ||
+      !a->plane.src_y || !a->plane.src_w || !a->plane.src_h ||
+      !a->plane.crtc_x || !a->plane.crtc_y || !a->plane.crtc_w ||
+      !a->plane.crtc_h) {
+    fprintf(stderr, "missing atomic properties for connector %u\n",
+            dev->conn_id);
+    goto err;
+  }
+
+  if (drmModeCreatePropertyBlob(fd, &dev->mode, sizeof(dev->mode),
+                                &a->mode_blob)) {
+    fprintf(stderr, "cannot create mode blob (%d): %m\n", errno);
+    goto err;
+  }
+
+  dev->atomic = a;
+  return 0;
+
+err:
+  free(a);
+  return -ENOTSUP;
+}
+
+static void add_plane(drmModeAtomicReq *req, struct drm_dev *dev,
+                      struct drm_buf *buf) {
+  struct drm_atomic *a = dev->atomic;
+
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.fb_id, buf->fb_id);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.crtc_id, dev->crtc_id);
+  /* source coordinates are 16.16 fixed point */
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.src_x, 0);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.src_y, 0);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.src_w,
+                           (uint64_t)buf->width << 16);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.src_h,
+                           (uint64_t)buf->height << 16);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.crtc_x, 0);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.crtc_y, 0);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.crtc_w,
+                           dev->mode.hdisplay);
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.crtc_h,
+                           dev->mode.vdisplay);
+}
+
+/* commit the whole output state: connector on CRTC, mode, front buffer */
+static int commit_modeset(struct drm_dev *dev, uint32_t flags) {
+  struct drm_atomic *a = dev->atomic;
+  drmModeAtomicReq *req;
+  int ret;
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -ENOMEM;
+
+  drmModeAtomicAddProperty(req, dev->conn_id, a->conn.crtc_id, dev->crtc_id);
+  drmModeAtomicAddProperty(req, dev->crtc_id, a->crtc.mode_id, a->mode_blob);
+  drmModeAtomicAddProperty(req, dev->crtc_id, a->crtc.active, 1);
+  add_plane(req, dev, &dev->bufs[dev->front_buf]);
+
+  ret = drmModeAtomicCommit(dev->fd, req, flags, NULL);
+  if (ret)
+    ret = -errno;
+  drmModeAtomicFree(req);
+  return ret;
+}
+
+static int atomic_modeset(struct drm_dev *dev) {
+  int ret;
+
+  /* same mode as on screen: the commit goes through without a modeset,
+   * which the kernel refuses if it would need one after all */
+  if (dev->mode_active && !commit_modeset(dev, 0))
+    return 0;
+  ret = commit_modeset(dev, DRM_MODE_ATOMIC_ALLOW_MODESET);
+  if (ret) {
+    errno = -ret;
+    fprintf(stderr, "atomic modeset on connector %u failed (%d): %m\n",
+            dev->conn_id, errno);
+  }
+  return ret;
+}
+
+/* Ask the driver whether the primary plane can show the buffers, which may
+ * be smaller than the mode and need scaling, without touching the screen. */
+int drm_atomic_test(struct drm_dev *dev) {
+  return commit_modeset(dev, DRM_MODE_ATOMIC_TEST_ONLY |
+                                 DRM_MODE_ATOMIC_ALLOW_MODESET);
+}
+
+/* time the fence signalled, which is when the flip completed */
+static uint64_t fence_time(int fd) {
+  struct sync_fence_info fence = {0};
+  struct sync_file_info info = {0};
+
+  info.num_fences = 1;
+  info.sync_fence_info = (uint64_t)(uintptr_t)&fence;
+  if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) || !fence.timestamp_ns)
+    return now_ns();
+  return fence.timestamp_ns;
+}
+
+/* wait until the commit in flight put its buffer on screen */
+static int atomic_wait(struct drm_dev *dev, int timeout_ms) {
+  struct drm_atomic *a = dev->atomic;
+  struct pollfd pfd;
+  int ret;
+
+  if (a->out_fence < 0)
+    return drm_wait_flip(dev, timeout_ms);
+
+  pfd.fd = a->out_fence;
+  pfd.events = POLLIN;
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+  if (ret == 0)
+    return -ETIMEDOUT;
+  if (ret > 0)
+    dev->flip_ns = fence_time(a->out_fence);
+  close(a->out_fence);
+  a->out_fence = -1;
+  return ret < 0 ? -errno : 0;
+}
+
+static int atomic_flip(struct drm_dev *dev, struct drm_buf *buf) {
+  struct drm_atomic *a = dev->atomic;
+  uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+  uint32_t damage = 0;
+  drmModeAtomicReq *req;
+  int ret;
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -ENOMEM;
+  drmModeAtomicAddProperty(req, a->plane_id, a->plane.fb_id, buf->fb_id);
+  /* no clips means all of it changed */
+  if (a->plane.fb_damage_clips && !drm_rect_empty(&buf->changed)) {
+    struct drm_mode_rect clip = {buf->changed.x0, buf->changed.y0,
+                                 buf->changed.x1, buf->changed.y1};
+
+    if (!drmModeCreatePropertyBlob(dev->fd, &clip, sizeof(clip), &damage))
+      drmModeAtomicAddProperty(req, a->plane_id, a->plane.fb_damage_clips,
+                               damage);
+  }
+
+  a->out_fence = -1;
+  if (a->crtc.out_fence_ptr) {
+    drmModeAtomicAddProperty(req, dev->crtc_id, a->crtc.out_fence_ptr,
+                             (uint64_t)(uintptr_t)&a->out_fence);
+  } else {
+    flags |= DRM_MODE_PAGE_FLIP_EVENT;
+    /* another thread may read the event before the commit returns */
+    dev->flip_pending = true;
+  }
+
+  ret = drmModeAtomicCommit(dev->fd, req, flags, dev);
+  drmModeAtomicFree(req);
+  /* the commit holds its own reference */
+  if (damage)
+    drmModeDestroyPropertyBlob(dev->fd, damage);
+  if (ret) {
+    ret = -errno;
+    fprintf(stderr, "atomic commit on connector %u failed (%d): %m\n",
+            dev->conn_id, errno);
+    dev->flip_pending = false;
+  }
+  return ret;
+}
+
+/* undo drm_atomic_setup_dev */
+void drm_atomic_free(struct drm_dev *dev) {
+  drmModeDestroyPropertyBlob(dev->fd, dev->atomic->mode_blob);
+  free(dev->atomic);
+  dev->atomic = NULL;
+}
+
+static void atomic_destroy(struct drm_dev *dev) {
+  if (dev->flip_buf >= 0)
+    atomic_wait(dev, FENCE_TIMEOUT_MS);
+  drm_atomic_free(dev);
+
+  /* restoring the saved CRTC and freeing the buffers works like legacy */
+  drm_kms_backend.destroy(dev);
+}
+
+const struct drm_backend drm_atomic_backend = {
+    .name = "atomic",
+    .modeset = atomic_modeset,
+    .flip = atomic_flip,
+    .wait = atomic_wait,
+    .destroy = atomic_destroy,
+};
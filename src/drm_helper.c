@@ -1,14 +1,27 @@
 #include <asm-generic/errno-base.h>
+#include <capture.h>
+#include <drm_atomic.h>
 #include <drm_helper.h>
+#include <format.h>
+#include <modes.h>
+#include <raster.h>
+#include <shadow.h>
 #include <stdlib.h>
+#include <telemetry.h>
 #include <utils.h>
+#include <workers.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/mman.h>
 
+/* a vblank never takes this long, if the flip did not complete by then it
+ * never will */
+#define FLIP_TIMEOUT_MS 1000
+
 int drm_dev_list_append(drm_dev_list **head, struct drm_dev *dev) {
   drm_dev_list *node = malloc(sizeof(drm_dev_list));
   if (node == NULL) {
@@ -49,13 +62,102 @@ static int drm_find_crtc(struct drm_manager *drm, struct drm_dev *dev,
                          drmModeConnector *conn);
 
 static int drm_create_fb(struct drm_dev *dev, struct drm_buf *buf);
+static void drm_destroy_fb(int fd, struct drm_buf *buf);
 
 void drm_manager_init(struct drm_manager *drm) {
   drm->devs = NULL;
+  drm->conns = NULL;
   drm->res = NULL;
+  drm->encs = NULL;
+  drm->crtcs = NULL;
+  drm->fast_start = false;
+  drm->dri_fd = -1;
+  drm->force_legacy = false;
+  drm->atomic = false;
+  drm->mode_spec = NULL;
+  drm->render_cost = NULL;
+  drm->render_cost_arg = NULL;
+  drm->nbufs = 2;
+  drm->format = &format_xrgb8888;
+  drm->scale = 1;
+  pthread_mutex_init(&drm->event_lock, NULL);
+}
+
+/* fetch all encoders and CRTCs once rather than per connector */
+static int drm_load_objects(struct drm_manager *drm) {
+  drmModeRes *res = drm->res;
+
+  drm->encs = calloc(res->count_encoders, sizeof(*drm->encs));
+  drm->crtcs = calloc(res->count_crtcs, sizeof(*drm->crtcs));
+  if ((res->count_encoders && !drm->encs) || (res->count_crtcs && !drm->crtcs))
+    return -ENOMEM;
+  for (int i = 0; i < res->count_encoders; i++) {
+    drm->encs[i] = drmModeGetEncoder(drm->dri_fd, res->encoders[i]);
+    if (!drm->encs[i])
+      fprintf(stderr, "cannot retrieve encoder %u:%u (%d): %m\n", i,
+              res->encoders[i], errno);
+  }
+  for (int i = 0; i < res->count_crtcs; i++)
+    drm->crtcs[i] = drmModeGetCrtc(drm->dri_fd, res->crtcs[i]);
+  return 0;
+}
+
+static void drm_free_objects(struct drm_manager *drm) {
+  for (int i = 0; drm->encs && i < drm->res->count_encoders; i++)
+    drmModeFreeEncoder(drm->encs[i]);
+  for (int i = 0; drm->crtcs && i < drm->res->count_crtcs; i++)
+    drmModeFreeCrtc(drm->crtcs[i]);
+  free(drm->encs);
+  free(drm->crtcs);
+  drm->encs = NULL;
+  drm->crtcs = NULL;
+}
+
+static drmModeEncoder *drm_find_encoder(struct drm_manager *drm, uint32_t id) {
+  for (int i = 0; i < drm->res->count_encoders; i++)
+    if (drm->encs[i] && drm->encs[i]->encoder_id == id)
+      return drm->encs[i];
+  return NULL;
+}
+
+static bool drm_crtc_used(struct drm_manager *drm, uint32_t crtc_id) {
+  for (struct drm_dev_list *iter = drm->devs; iter; iter = iter->next)
+    if (iter->dev->crtc_id == crtc_id)
+      return true;
+  return false;
+}
+
+/* The full probe of drmModeGetConnector reads EDID and can take hundreds
+ * of ms per output. With fast_start take what the kernel knows already,
+ * unless it never probed the connector, as right after boot. */
+static drmModeConnector *drm_get_connector(struct drm_manager *drm,
+                                           uint32_t id) {
+  drmModeConnector *conn;
+
+  if (!drm->fast_start)
+    return drmModeGetConnector(drm->dri_fd, id);
+  conn = drmModeGetConnectorCurrent(drm->dri_fd, id);
+  if (conn && (conn->connection == DRM_MODE_DISCONNECTED || conn->count_modes))
+    return conn;
+  drmModeFreeConnector(conn);
+  return drmModeGetConnector(drm->dri_fd, id);
+}
+
+/* the CRTC showing something on conn right now, if no device took it */
+static drmModeCrtc *drm_current_crtc(struct drm_manager *drm,
+                                     drmModeConnector *conn) {
+  drmModeEncoder *enc = drm_find_encoder(drm, conn->encoder_id);
+
+  if (!enc || !enc->crtc_id || drm_crtc_used(drm, enc->crtc_id))
+    return NULL;
+  for (int i = 0; i < drm->res->count_crtcs; i++)
+    if (drm->crtcs[i] && drm->crtcs[i]->crtc_id == enc->crtc_id)
+      return drm->crtcs[i]->mode_valid ? drm->crtcs[i] : NULL;
+  return NULL;
 }
 
 int registerConnectors(struct drm_manager *drm) {
+  uint64_t start = now_ns();
   drmModeConnector *conn;
   struct drm_dev *dev;
   int ret;
@@ -67,10 +169,13 @@ int registerConnectors(struct drm_manager *drm) {
     fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n", errno);
     return -errno;
   }
+  ret = drm_load_objects(drm);
+  if (ret)
+    return ret;
   /* iterate all connectors */
   for (int i = 0; i < res->count_connectors; ++i) {
     /* get information for each connector */
-    conn = drmModeGetConnector(drm->dri_fd, res->connectors[i]);
+    conn = drm_get_connector(drm, res->connectors[i]);
     if (!conn) {
       fprintf(stderr, "cannot retrieve DRM connector %u:%u (%d): %m\n", i,
               res->connectors[i], errno);
@@ -79,7 +184,9 @@ int registerConnectors(struct drm_manager *drm) {
     /* create new device structure */
     dev = malloc(sizeof(*dev));
     memset(dev, 0, sizeof(*dev));
+    dev->backend = &drm_kms_backend;
     dev->fd = drm->dri_fd;
+    dev->event_lock = &drm->event_lock;
     dev->conn_id = conn->connector_id;
     /* setup this connector */
     ret = drm_setup_dev(drm, dev, conn);
@@ -99,11 +206,39 @@ int registerConnectors(struct drm_manager *drm) {
     drm_dev_list_append(&drm->devs, dev);
   }
 
+  LOG("connectors discovered in %.1f ms\n", (now_ns() - start) / 1e6);
+  return 0;
+}
+
+/* create the nbufs framebuffers of the swapchain at width x height */
+static int drm_create_bufs(struct drm_dev *dev, uint32_t width,
+                           uint32_t height) {
+  for (unsigned int i = 0; i < dev->nbufs; i++) {
+    dev->bufs[i].width = width;
+    dev->bufs[i].height = height;
+    int ret = drm_create_fb(dev, &dev->bufs[i]);
+
+    if (ret) {
+      fprintf(stderr, "cannot create framebuffer for connector %u\n",
+              dev->conn_id);
+      while (i--)
+        drm_destroy_fb(dev->fd, &dev->bufs[i]);
+      return ret;
+    }
+  }
+  drm_swap_init(dev);
   return 0;
 }
 
+static void drm_destroy_bufs(struct drm_dev *dev) {
+  for (unsigned int i = 0; i < dev->nbufs; i++)
+    drm_destroy_fb(dev->fd, &dev->bufs[i]);
+}
+
 int drm_setup_dev(struct drm_manager *drm, struct drm_dev *dev,
                   drmModeConnector *conn) {
+  drmModeCrtc *current;
+  unsigned int scale;
   int ret;
   /* check if a monitor is connected */
   if (conn->connection != DRM_MODE_CONNECTED) {
@@ -117,16 +252,20 @@ int drm_setup_dev(struct drm_manager *drm, struct drm_dev *dev,
     return -EFAULT;
   }
 
-  /* copy the mode information into our device buffer structure */
-  /* TODO: this is always first mode here. selection would be nice
-   */
-  memcpy(&dev->mode, &conn->modes[0], sizeof(dev->mode));
-  dev->bufs[0].width = conn->modes[0].hdisplay;
-  dev->bufs[0].height = conn->modes[0].vdisplay;
-  dev->bufs[1].width = conn->modes[0].hdisplay;
-  dev->bufs[1].height = conn->modes[0].vdisplay;
-  fprintf(stderr, "mode for connector %u is %ux%u\n", conn->connector_id,
-          dev->bufs[0].width, dev->bufs[0].height);
+  /* copy the mode information into our device buffer structure, keeping
+   * the one on screen if fast_start has no other wish */
+  current = drm_current_crtc(drm, conn);
+  if (drm->fast_start && !drm->mode_spec && current) {
+    dev->mode = current->mode;
+  } else {
+    ret = mode_pick(drm, conn, &dev->mode);
+    if (ret)
+      return ret;
+  }
+  dev->nbufs = drm->nbufs;
+  dev->format = drm->format;
+  fprintf(stderr, "mode for connector %u is %s@%u\n", conn->connector_id,
+          dev->mode.name, dev->mode.vrefresh);
 
   /* find a crtc for this connector */
   ret = drm_find_crtc(drm, dev, conn);
@@ -134,20 +273,40 @@ int drm_setup_dev(struct drm_manager *drm, struct drm_dev *dev,
     fprintf(stderr, "no valid crtc for connector %u\n", conn->connector_id);
     return ret;
   }
-
-  /* create a framebuffer for this CRTC */
-  ret = drm_create_fb(dev, &dev->bufs[0]);
-  if (ret) {
-    fprintf(stderr, "cannot create framebuffer for connector %u\n",
-            conn->connector_id);
-    return ret;
-  }
-  /* create framebuffer #2 for this CRTC */
-  ret = drm_create_fb(dev, &dev->bufs[1]);
-  if (ret) {
-    fprintf(stderr, "cannot create framebuffer for connector %u\n",
-            conn->connector_id);
+  dev->mode_active = drm->fast_start && current &&
+                     current->crtc_id == dev->crtc_id &&
+                     mode_equal(&current->mode, &dev->mode);
+
+  /* create the framebuffers of the swapchain for this CRTC, smaller than the
+   * mode if the plane is to scale them up */
+  scale = drm->scale > 1 ? drm->scale : 1;
+  ret = drm_create_bufs(dev, dev->mode.hdisplay / scale,
+                        dev->mode.vdisplay / scale);
+  if (ret)
     return ret;
+
+  /* prefer atomic commits, the legacy API stays as fallback */
+  if (drm->atomic && drm_atomic_setup_dev(drm, dev) == 0)
+    dev->backend = &drm_atomic_backend;
+  fprintf(stderr, "using %s backend for connector %u\n", dev->backend->name,
+          conn->connector_id);
+
+  /* only atomic can tell up front whether the plane scales */
+  if (scale > 1 &&
+      (dev->backend != &drm_atomic_backend || drm_atomic_test(dev))) {
+    fprintf(stderr, "connector %u cannot scale %ux%u, rendering at %ux%u\n",
+            conn->connector_id, dev->bufs[0].width, dev->bufs[0].height,
+            dev->mode.hdisplay, dev->mode.vdisplay);
+    drm_destroy_bufs(dev);
+    ret = drm_create_bufs(dev, dev->mode.hdisplay, dev->mode.vdisplay);
+    if (ret) {
+      if (dev->atomic)
+        drm_atomic_free(dev);
+      return ret;
+    }
+  } else if (scale > 1) {
+    fprintf(stderr, "connector %u renders at %ux%u, scaled by the plane\n",
+            conn->connector_id, dev->bufs[0].width, dev->bufs[0].height);
   }
 
   return 0;
@@ -156,32 +315,12 @@ int drm_setup_dev(struct drm_manager *drm, struct drm_dev *dev,
 static int drm_find_crtc(struct drm_manager *drm, struct drm_dev *dev,
                          drmModeConnector *conn) {
   drmModeEncoder *enc;
-  int32_t crtc;
 
   /* first try the currently connected encoder+crtc */
-  if (conn->encoder_id)
-    enc = drmModeGetEncoder(dev->fd, conn->encoder_id);
-  else
-    enc = NULL;
-
-  if (enc) {
-    if (enc->crtc_id) {
-      crtc = enc->crtc_id;
-      for (struct drm_dev_list *iter = drm->devs; iter != NULL; iter = iter->next) {
-        if (iter->dev->crtc_id == (uint32_t)crtc) {
-          crtc = -1;
-          break;
-        }
-      }
-
-      if (crtc >= 0) {
-        drmModeFreeEncoder(enc);
-        dev->crtc_id = crtc;
-        return 0;
-      }
-    }
-
-    drmModeFreeEncoder(enc);
+  enc = drm_find_encoder(drm, conn->encoder_id);
+  if (enc && enc->crtc_id && !drm_crtc_used(drm, enc->crtc_id)) {
+    dev->crtc_id = enc->crtc_id;
+    return 0;
   }
 
   /* If the connector is not currently bound to an encoder or if the
@@ -189,38 +328,23 @@ static int drm_find_crtc(struct drm_manager *drm, struct drm_dev *dev,
    * but lets be safe), iterate all other available encoders to find a
    * matching CRTC. */
   for (int i = 0; i < conn->count_encoders; ++i) {
-    enc = drmModeGetEncoder(dev->fd, conn->encoders[i]);
-    if (!enc) {
-      fprintf(stderr, "cannot retrieve encoder %u:%u (%d): %m\n", i,
-              conn->encoders[i], errno);
+    enc = drm_find_encoder(drm, conn->encoders[i]);
+    if (!enc)
       continue;
-    }
 
     drmModeRes *res = drm->res;
     /* iterate all global CRTCs */
     for (int j = 0; j < res->count_crtcs; ++j) {
-      /* check whether this CRTC works with the encoder */
-      if (!(enc->possible_crtcs & (1 << j)))
+      /* check whether this CRTC works with the encoder and that no other
+       * device already uses it */
+      if (!(enc->possible_crtcs & (1 << j)) ||
+          drm_crtc_used(drm, res->crtcs[j]))
         continue;
 
-      /* check that no other device already uses this CRTC */
-      crtc = res->crtcs[j];
-      for (struct drm_dev_list *iter = drm->devs; iter; iter = iter->next) {
-        struct drm_dev *dev = iter->dev;
-        if (dev->crtc_id == (uint32_t)crtc) {
-          crtc = -1;
-          break;
-        }
-      }
-
       /* we have found a CRTC, so save it and return */
-      if (crtc >= 0) {
-        drmModeFreeEncoder(enc);
-        dev->crtc_id = crtc;
-        return 0;
-      }
+      dev->crtc_id = res->crtcs[j];
+      return 0;
     }
-    drmModeFreeEncoder(enc);
   }
 
   fprintf(stderr, "cannot find suitable CRTC for connector %u\n",
@@ -233,13 +357,14 @@ int drm_create_fb(struct drm_dev *dev, struct drm_buf *buf) {
   struct drm_mode_create_dumb creq;
   struct drm_mode_destroy_dumb dreq;
   struct drm_mode_map_dumb mreq;
+  uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
   int ret;
 
   /* create dumb buffer */
   memset(&creq, 0, sizeof(creq));
   creq.width = buf->width;
   creq.height = buf->height;
-  creq.bpp = 32;
+  creq.bpp = dev->format->cpp * 8;
   ret = drmIoctl(dev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
   if (ret < 0) {
     fprintf(stderr, "cannot create dumb buffer (%d): %m\n", errno);
@@ -250,10 +375,13 @@ int drm_create_fb(struct drm_dev *dev, struct drm_buf *buf) {
   buf->handle = creq.handle;
 
   /* create framebuffer object for the dumb-buffer */
-  ret = drmModeAddFB(dev->fd, buf->width, buf->height, 24, 32, buf->stride,
-                     buf->handle, &buf->fb_id);
+  handles[0] = buf->handle;
+  pitches[0] = buf->stride;
+  ret = drmModeAddFB2(dev->fd, buf->width, buf->height, dev->format->fourcc,
+                      handles, pitches, offsets, &buf->fb_id, 0);
   if (ret) {
-    fprintf(stderr, "cannot create framebuffer (%d): %m\n", errno);
+    fprintf(stderr, "cannot create %s framebuffer (%d): %m\n",
+            dev->format->name, errno);
     ret = -errno;
     goto err_destroy;
   }
@@ -291,50 +419,344 @@ err_destroy:
   return ret;
 }
 
-int flip_buffer(struct drm_dev *dev) {
-  int ret =
-      drmModeSetCrtc(dev->fd, dev->crtc_id, dev->bufs[dev->front_buf ^ 1].fb_id,
-                     0, 0, &dev->conn_id, 1, &dev->mode);
-  if (ret)
-    fprintf(stderr, "cannot flip CRTC for connector %u (%d): %m\n",
+static int kms_modeset(struct drm_dev *dev) {
+  struct drm_buf *buf = &dev->bufs[dev->front_buf];
+  int ret;
+
+  /* the mode is set already, a flip replaces the picture without the
+   * blank a full modeset may cause; modeset if the driver refuses */
+  if (dev->mode_active) {
+    dev->flip_pending = true;
+    if (!drmModePageFlip(dev->fd, dev->crtc_id, buf->fb_id,
+                         DRM_MODE_PAGE_FLIP_EVENT, dev) &&
+        !drm_wait_flip(dev, FLIP_TIMEOUT_MS))
+      return 0;
+    dev->flip_pending = false;
+  }
+
+  ret = drmModeSetCrtc(dev->fd, dev->crtc_id, buf->fb_id, 0, 0, &dev->conn_id,
+                       1, &dev->mode);
+  if (ret) {
+    ret = -errno;
+    fprintf(stderr, "cannot set CRTC for connector %u (%d): %m\n",
             dev->conn_id, errno);
-  else
-    dev->front_buf ^= 1;
+  }
+  return ret;
+}
+
+static void page_flip_handler(int fd, unsigned int frame, unsigned int sec,
+                              unsigned int usec, void *data) {
+  struct drm_dev *dev = data;
+
+  (void)fd;
+  (void)frame;
+  /* event timestamps are CLOCK_MONOTONIC, as is now_ns */
+  dev->flip_ns = sec * 1000000000ull + usec * 1000ull;
+  dev->flip_pending = false;
+}
+
+/* Wait up to timeout_ms for DRM events on fd and dispatch them.
+ * Returns 0 if events were handled, -ETIMEDOUT or -errno otherwise. */
+int drm_handle_events(int fd, int timeout_ms) {
+  drmEventContext ev = {
+      .version = 2,
+      .page_flip_handler = page_flip_handler,
+  };
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int ret;
+
+  ret = poll(&pfd, 1, timeout_ms);
+  if (ret < 0)
+    return errno == EINTR ? 0 : -errno;
+  if (ret == 0)
+    return -ETIMEDOUT;
+  if (drmHandleEvent(fd, &ev))
+    return -errno;
   return 0;
 }
 
-void drm_cleanup(struct drm_manager *drm) {
-  struct drm_dev *iter;
-  struct drm_mode_destroy_dumb dreq;
+/* Take the lock for reading events, without blocking unless block is set */
+static bool lock_events(struct drm_dev *dev, bool block) {
+  if (!dev->event_lock)
+    return true;
+  if (block)
+    return !pthread_mutex_lock(dev->event_lock);
+  return !pthread_mutex_trylock(dev->event_lock);
+}
 
-  drm_dev_list *devs = drm->devs;
-  while (devs != NULL) {
-    struct drm_dev *dev = devs->dev;
-    /* remove from global list */
-    drm->devs = devs->next;
+static void unlock_events(struct drm_dev *dev) {
+  if (dev->event_lock)
+    pthread_mutex_unlock(dev->event_lock);
+}
+
+/* Wait up to timeout_ms for the completion event of an outstanding page
+ * flip, -ETIMEDOUT if it did not come. Several threads may wait on devices
+ * sharing an fd: whoever holds the event lock reads and dispatches the
+ * events of all of them. */
+int drm_wait_flip(struct drm_dev *dev, int timeout_ms) {
+  uint64_t deadline = now_ns() + timeout_ms * 1000000ull;
+  int ret = 0;
+
+  while (dev->flip_pending) {
+    uint64_t now = now_ns();
+    int wait_ms = now < deadline ? (deadline - now + 999999) / 1000000 : 0;
+
+    if (!lock_events(dev, wait_ms > 0))
+      return -ETIMEDOUT;
+    /* the holder before may have read our event */
+    if (dev->flip_pending)
+      ret = drm_handle_events(dev->fd, wait_ms);
+    unlock_events(dev);
+    if (ret)
+      break;
+  }
+  return ret;
+}
+
+static int kms_wait(struct drm_dev *dev, int timeout_ms) {
+  return drm_wait_flip(dev, timeout_ms);
+}
+
+static int kms_flip(struct drm_dev *dev, struct drm_buf *buf) {
+  int ret;
 
-    /* restore saved CRTC configuration */
-    drmModeSetCrtc(drm->dri_fd, dev->saved_crtc->crtc_id,
+  /* mark it first, another thread may read the event before we return */
+  dev->flip_pending = true;
+  ret = drmModePageFlip(dev->fd, dev->crtc_id, buf->fb_id,
+                        DRM_MODE_PAGE_FLIP_EVENT, dev);
+  if (ret) {
+    ret = -errno;
+    fprintf(stderr, "cannot flip CRTC for connector %u (%d): %m\n",
+            dev->conn_id, errno);
+    dev->flip_pending = false;
+  }
+  return ret;
+}
+
+static void kms_destroy(struct drm_dev *dev) {
+  /* do not pull buffers from under a flip still in flight */
+  drm_wait_flip(dev, FLIP_TIMEOUT_MS);
+
+  /* restore saved CRTC configuration */
+  if (dev->saved_crtc) {
+    drmModeSetCrtc(dev->fd, dev->saved_crtc->crtc_id,
                    dev->saved_crtc->buffer_id, dev->saved_crtc->x,
                    dev->saved_crtc->y, &dev->conn_id, 1,
                    &dev->saved_crtc->mode);
     drmModeFreeCrtc(dev->saved_crtc);
+  }
+
+  /* unmap buffers, delete framebuffers and dumb buffers */
+  drm_destroy_bufs(dev);
+}
+
+const struct drm_backend drm_kms_backend = {
+    .name = "kms",
+    .modeset = kms_modeset,
+    .flip = kms_flip,
+    .wait = kms_wait,
+    .destroy = kms_destroy,
+};
+
+/* Duration of one refresh cycle of the mode in ns, 0 without a display */
+uint64_t drm_refresh_ns(const struct drm_dev *dev) {
+  if (!dev->backend->wait)
+    return 0;
+  return mode_period_ns(&dev->mode);
+}
+
+/* Save the current CRTC configuration for drm_cleanup and show the front
+ * buffer on the device */
+int drm_modeset(struct drm_dev *dev) {
+  if (!dev->backend->modeset)
+    return 0;
+  dev->saved_crtc = drmModeGetCrtc(dev->fd, dev->crtc_id);
+  return dev->backend->modeset(dev);
+}
+
+/* Start the swapchain of freshly created buffers: buffer 0 is shown,
+ * buffer 1 acquired for the first frame */
+void drm_swap_init(struct drm_dev *dev) {
+  for (unsigned int i = 0; i < dev->nbufs; i++) {
+    dev->bufs[i].state = DRM_BUF_FREE;
+    /* new buffers are all background */
+    memset(&dev->bufs[i].damage, 0, sizeof(dev->bufs[i].damage));
+  }
+  memset(&dev->presented, 0, sizeof(dev->presented));
+  dev->front_buf = 0;
+  dev->bufs[0].state = DRM_BUF_SCANOUT;
+  dev->back_buf = 1;
+  dev->bufs[1].state = DRM_BUF_ACQUIRED;
+  dev->flip_buf = -1;
+  dev->queued = 0;
+  dev->flip_pending = false;
+}
+
+static int swap_retire(struct drm_dev *dev, int timeout_ms);
+
+static int swap_submit(struct drm_dev *dev, unsigned int i) {
+  int ret = dev->backend->flip(dev, &dev->bufs[i]);
+
+  if (ret) {
+    /* the frame is lost, the buffer can still be reused */
+    dev->bufs[i].state = DRM_BUF_FREE;
+    return ret;
+  }
+  dev->bufs[i].state = DRM_BUF_FLIPPING;
+  dev->flip_buf = i;
+  /* without a display the flip is already done */
+  return dev->backend->wait ? 0 : swap_retire(dev, 0);
+}
+
+/* Retire the flip in flight if it completes within timeout_ms: its buffer
+ * is now shown and the one it replaced released. The oldest queued buffer,
+ * if any, gets the next flip. */
+static int swap_retire(struct drm_dev *dev, int timeout_ms) {
+  unsigned int next;
+  int ret;
+
+  if (dev->flip_buf >= 0) {
+    struct drm_buf *shown = &dev->bufs[dev->flip_buf];
+
+    if (dev->backend->wait) {
+      ret = dev->backend->wait(dev, timeout_ms);
+      if (ret)
+        return ret;
+    } else {
+      dev->flip_ns = now_ns();
+    }
+    if (dev->tm)
+      telemetry_push(dev->tm, shown->render_ns, shown->submit_ns,
+                     dev->flip_ns);
+    dev->bufs[dev->front_buf].state = DRM_BUF_FREE;
+    dev->front_buf = dev->flip_buf;
+    dev->bufs[dev->front_buf].state = DRM_BUF_SCANOUT;
+    dev->flip_buf = -1;
+  }
+  if (!dev->queued)
+    return 0;
+  next = dev->queue[0];
+  dev->queued--;
+  memmove(dev->queue, dev->queue + 1, dev->queued);
+  return swap_submit(dev, next);
+}
+
+/* Acquire a free buffer as back buffer. If all of them are shown, in
+ * flight or queued, wait for a flip to release one if block is set and
+ * return -EAGAIN else. */
+static int swap_acquire(struct drm_dev *dev, bool block) {
+  int ret;
+
+  if (drm_back_buf(dev)->state == DRM_BUF_ACQUIRED)
+    return 0;
+  for (;;) {
+    ret = swap_retire(dev, 0);
+    if (ret && ret != -ETIMEDOUT)
+      return ret;
+    for (unsigned int i = 0; i < dev->nbufs; i++) {
+      if (dev->bufs[i].state == DRM_BUF_FREE) {
+        dev->bufs[i].state = DRM_BUF_ACQUIRED;
+        dev->back_buf = i;
+        return 0;
+      }
+    }
+    if (!block)
+      return -EAGAIN;
+    if (dev->flip_buf < 0)
+      return -EBUSY;
+    ret = swap_retire(dev, FLIP_TIMEOUT_MS);
+    if (ret) {
+      errno = -ret;
+      fprintf(stderr, "page flip on connector %u did not complete (%d): %m\n",
+              dev->conn_id, errno);
+      return ret;
+    }
+  }
+}
+
+/* Present the back buffer. Returns without waiting for vblank: the buffer
+ * is flipped to at once if no flip is in flight, else queued behind it.
+ * In shadow mode the back buffer is only acquired and written here. */
+int flip_buffer(struct drm_dev *dev) {
+  uint64_t submit = now_ns();
+  int ret;
 
-    /* unmap buffer */
-    munmap(dev->bufs[0].map, dev->bufs[0].size);
+  ret = swap_acquire(dev, true);
+  if (ret)
+    return ret;
+  if (dev->shadow)
+    shadow_upload(dev);
+  else
+    drm_back_buf(dev)->damage = dev->dirty;
+  /* a frame differs from the one before where either of them drew */
+  drm_back_buf(dev)->changed = dev->dirty;
+  drm_rect_union(&drm_back_buf(dev)->changed, &dev->presented);
+  dev->presented = dev->dirty;
+  /* reading back the shadow is cheap, the buffer may be uncached */
+  if (dev->capture)
+    capture_frame(dev->capture,
+                  dev->shadow ? dev->shadow : drm_back_buf(dev)->map,
+                  drm_back_buf(dev)->stride);
+  drm_back_buf(dev)->render_ns = dev->render_ns;
+  drm_back_buf(dev)->submit_ns = submit;
+
+  ret = swap_retire(dev, 0);
+  if (ret && ret != -ETIMEDOUT)
+    return ret;
+  if (dev->flip_buf < 0) {
+    ret = swap_submit(dev, dev->back_buf);
+    if (ret)
+      return ret;
+  } else {
+    drm_back_buf(dev)->state = DRM_BUF_QUEUED;
+    dev->queue[dev->queued++] = dev->back_buf;
+  }
+  /* start the next frame right away if a buffer is free already */
+  swap_acquire(dev, false);
+  return 0;
+}
 
-    /* delete framebuffer */
-    drmModeRmFB(drm->dri_fd, dev->bufs[0].fb_id);
+/* Acquire a back buffer to draw into. With more than two buffers this only
+ * blocks if the renderer got ahead of the display by the whole swapchain.
+ * Drawing never touches it in shadow mode, so nothing to wait for there. */
+int wait_buffer(struct drm_dev *dev) {
+  if (dev->shadow)
+    return 0;
+  return swap_acquire(dev, true);
+}
 
-    /* delete dumb buffer */
-    memset(&dreq, 0, sizeof(dreq));
-    dreq.handle = dev->bufs[0].handle;
-    drmIoctl(drm->dri_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+/* Release the buffers of dev and everything drawing attached to it: shadow,
+ * line bins, worker pool and telemetry. dev itself stays the caller's. A
+ * pool shared by several devices has to be taken off all of them first. */
+void drm_dev_teardown(struct drm_dev *dev) {
+  dev->backend->destroy(dev);
+  shadow_disable(dev);
+  telemetry_free(dev->tm);
+  dev->tm = NULL;
+  if (dev->bins) {
+    raster_bins_free(dev->bins);
+    free(dev->bins);
+    dev->bins = NULL;
+  }
+  worker_pool_destroy(dev->pool);
+  dev->pool = NULL;
+}
 
-    /* free allocated memory */
+void drm_cleanup(struct drm_manager *drm) {
+  drm_dev_list *devs;
+  while ((devs = drm->devs) != NULL) {
+    struct drm_dev *dev = devs->dev;
+    /* remove from global list */
+    drm->devs = devs->next;
+
+    drm_dev_teardown(dev);
     free(dev);
+    free(devs);
   }
+  if (drm->res)
+    drm_free_objects(drm);
   drmModeFreeResources(drm->res);
+  drm->res = NULL;
 }
 
 int drm_open(struct drm_manager *drm, const char *path) {
@@ -357,11 +779,20 @@ int drm_open(struct drm_manager *drm, const char *path) {
     ERROR("drm device '%s' does not support dumb buffers\n", path);
     return -ENOTSUP;
   }
+
+  /* atomic modesetting implies universal planes */
+  drm->atomic = false;
+  if (!drm->force_legacy) {
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+      drm->atomic = true;
+    else
+      LOG("drm device '%s' does not support atomic modesetting\n", path);
+  }
   drm->dri_fd = fd;
   return EXIT_SUCCESS;
 }
 
-void drm_destroy_fb(int fd, struct drm_buf *buf) {
+static void drm_destroy_fb(int fd, struct drm_buf *buf) {
   struct drm_mode_destroy_dumb dreq;
 
   /* unmap buffer */
@@ -375,68 +806,3 @@ void drm_destroy_fb(int fd, struct drm_buf *buf) {
   dreq.handle = buf->handle;
   drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
 }
-
-void connector_find_mode(struct drm_manager *drm, struct connector *c) {
-  drmModeConnector *connector;
-  int i, j;
-  drmModeRes *resources = drm->res;
-  /* First, find the connector & mode */
-  c->mode = NULL;
-  for (i = 0; i < resources->count_connectors; i++) {
-    connector = drmModeGetConnector(drm->dri_fd, resources->connectors[i]);
-
-    if (!connector) {
-      fprintf(stderr, "could not get connector %i: %s\n",
-              resources->connectors[i], strerror(errno));
-      drmModeFreeConnector(connector);
-      continue;
-    }
-
-    if (!connector->count_modes) {
-      drmModeFreeConnector(connector);
-      continue;
-    }
-
-    if (connector->connector_id != c->id) {
-      drmModeFreeConnector(connector);
-      continue;
-    }
-
-    for (j = 0; j < connector->count_modes; j++) {
-      c->mode = &connector->modes[j];
-      if (!strcmp(c->mode->name, c->mode_str))
-        break;
-    }
-
-    /* Found it, break out */
-    if (c->mode)
-      break;
-
-    drmModeFreeConnector(connector);
-  }
-
-  if (!c->mode) {
-    fprintf(stderr, "failed to find mode \"%s\"\n", c->mode_str);
-    return;
-  }
-
-  /* Now get the encoder */
-  for (i = 0; i < resources->count_encoders; i++) {
-    c->encoder = drmModeGetEncoder(drm->dri_fd, resources->encoders[i]);
-
-    if (!c->encoder) {
-      fprintf(stderr, "could not get encoder %i: %s\n", resources->encoders[i],
-              strerror(errno));
-      drmModeFreeEncoder(c->encoder);
-      continue;
-    }
-
-    if (c->encoder->encoder_id == connector->encoder_id)
-      break;
-
-    drmModeFreeEncoder(c->encoder);
-  }
-
-  if (c->crtc == -1)
-    c->crtc = c->encoder->crtc_id;
-}
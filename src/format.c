@@ -0,0 +1,77 @@
+/*
+ * Pixel Formats.
+ * Colors are 8 bits per channel. Narrower formats drop the low bits, wider
+ * ones repeat the high bits into the new low ones so that full intensity
+ * stays full intensity.
+ */
+
+#include <string.h>
+
+#include <drm_fourcc.h>
+#include <format.h>
+
+static uint32_t pack_xrgb8888(color c) {
+  return (c.r << 16) | (c.g << 8) | c.b;
+}
+
+static color unpack_xrgb8888(uint32_t p) {
+  return (color){(p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff};
+}
+
+static uint32_t pack_rgb565(color c) {
+  return ((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3);
+}
+
+/* repeat the high bits like widen10 */
+static color unpack_rgb565(uint32_t p) {
+  int r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+
+  return (color){(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2)};
+}
+
+static inline uint32_t widen10(int v) { return (v << 2) | (v >> 6); }
+
+static uint32_t pack_xrgb2101010(color c) {
+  return (widen10(c.r) << 20) | (widen10(c.g) << 10) | widen10(c.b);
+}
+
+static color unpack_xrgb2101010(uint32_t p) {
+  return (color){(p >> 22) & 0xff, (p >> 12) & 0xff, (p >> 2) & 0xff};
+}
+
+const struct pixel_format format_xrgb8888 = {
+    .name = "xrgb8888",
+    .fourcc = DRM_FORMAT_XRGB8888,
+    .cpp = 4,
+    .pack = pack_xrgb8888,
+    .unpack = unpack_xrgb8888,
+};
+
+const struct pixel_format format_rgb565 = {
+    .name = "rgb565",
+    .fourcc = DRM_FORMAT_RGB565,
+    .cpp = 2,
+    .pack = pack_rgb565,
+    .unpack = unpack_rgb565,
+};
+
+const struct pixel_format format_xrgb2101010 = {
+    .name = "xrgb2101010",
+    .fourcc = DRM_FORMAT_XRGB2101010,
+    .cpp = 4,
+    .pack = pack_xrgb2101010,
+    .unpack = unpack_xrgb2101010,
+};
+
+static const struct pixel_format *formats[] = {
+    &format_xrgb8888,
+    &format_rgb565,
+    &format_xrgb2101010,
+};
+
+const struct pixel_format *format_find(const char *name) {
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    if (!strcmp(formats[i]->name, name))
+      return formats[i];
+  return NULL;
+}
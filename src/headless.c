@@ -0,0 +1,127 @@
+/*
+ * Headless Backend.
+ * Keeps the buffers of a drm_dev in plain memory instead of dumb buffers, so
+ * the renderer can run (and be profiled) without a /dev/dri card and at any
+ * resolution. Flipping only swaps the buffers, nothing is scanned out.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <format.h>
+#include <headless.h>
+#include <utils.h>
+
+#define HUGEPAGE_SIZE (2u << 20)
+
+static size_t align_up(size_t v, size_t a) { return (v + a - 1) & ~(a - 1); }
+
+static int headless_alloc(struct drm_buf *buf, uint32_t cpp, bool hugepages) {
+  size_t size;
+  void *map = MAP_FAILED;
+
+  /* keep the same row alignment as most dumb buffer implementations */
+  buf->stride = align_up(buf->width * cpp, 64);
+  buf->pitch = buf->stride;
+  size = (size_t)buf->stride * buf->height;
+
+  if (hugepages) {
+    /* explicit hugetlbfs pages first, transparent hugepages otherwise */
+    size = align_up(size, HUGEPAGE_SIZE);
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map == MAP_FAILED)
+      LOG("no hugetlb pages available, falling back to THP\n");
+  }
+  if (map == MAP_FAILED) {
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "cannot allocate headless buffer (%d): %m\n", errno);
+      return -errno;
+    }
+    if (hugepages)
+      madvise(map, size, MADV_HUGEPAGE);
+  }
+
+  buf->size = size;
+  buf->map = map;
+  /* fault all pages in now rather than inside the first frame */
+  memset(buf->map, 0, buf->size);
+  return 0;
+}
+
+/* nothing scans out, the flip is complete as soon as it started */
+static int headless_flip(struct drm_dev *dev, struct drm_buf *buf) {
+  (void)dev;
+  (void)buf;
+  return 0;
+}
+
+static void headless_destroy(struct drm_dev *dev) {
+  for (unsigned int i = 0; i < dev->nbufs; i++) {
+    if (dev->bufs[i].map)
+      munmap(dev->bufs[i].map, dev->bufs[i].size);
+  }
+}
+
+const struct drm_backend headless_backend = {
+    .name = "headless",
+    .cached = true,
+    .flip = headless_flip,
+    .destroy = headless_destroy,
+};
+
+/* format NULL is XRGB8888 */
+int headless_setup_dev(struct drm_dev *dev, uint32_t width, uint32_t height,
+                       const struct pixel_format *format, unsigned int nbufs,
+                       bool hugepages) {
+  int ret;
+
+  memset(dev, 0, sizeof(*dev));
+  dev->backend = &headless_backend;
+  dev->fd = -1;
+
+  /* fake a mode, so callers can treat the device like a real output */
+  dev->mode.hdisplay = width;
+  dev->mode.vdisplay = height;
+  dev->mode.vrefresh = 60;
+  snprintf(dev->mode.name, sizeof(dev->mode.name), "%ux%u", width, height);
+
+  dev->format = format ? format : &format_xrgb8888;
+  dev->nbufs = nbufs;
+  for (unsigned int i = 0; i < dev->nbufs; i++) {
+    dev->bufs[i].width = width;
+    dev->bufs[i].height = height;
+    ret = headless_alloc(&dev->bufs[i], dev->format->cpp, hugepages);
+    if (ret) {
+      headless_destroy(dev);
+      return ret;
+    }
+  }
+  drm_swap_init(dev);
+  return 0;
+}
+
+int headless_register(struct drm_manager *drm, uint32_t width, uint32_t height,
+                      bool hugepages) {
+  struct drm_dev *dev;
+  int ret;
+
+  dev = malloc(sizeof(*dev));
+  if (dev == NULL)
+    return -ENOMEM;
+
+  ret = headless_setup_dev(dev, width, height, drm->format, drm->nbufs,
+                           hugepages);
+  if (ret) {
+    free(dev);
+    return ret;
+  }
+  fprintf(stderr, "headless device is %ux%u %s%s\n", width, height,
+          dev->format->name, hugepages ? " (hugepages)" : "");
+  return drm_dev_list_append(&drm->devs, dev);
+}
@@ -0,0 +1,276 @@
+/*
+ * Multi-Head Rendering.
+ * Every device gets its own animation state. A frame is first rendered for
+ * all heads, then all heads are flipped back to back, so outputs driven by
+ * the same card change picture in the same vblank as far as their CRTCs
+ * allow. In threaded mode the heads render in parallel and meet in
+ * head_sync before flipping.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <dlist.h>
+#include <draw.h>
+#include <headless.h>
+#include <heads.h>
+#include <perfctr.h>
+#include <utils.h>
+#include <wall.h>
+#include <workers.h>
+
+struct head_sync {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int n;
+  unsigned int arrived;
+  unsigned long generation;
+  bool ok;
+  bool result;
+};
+
+struct head {
+  struct drm_dev *dev;
+  struct tt_anim anim;
+  /* drawn instead of anim if it has cells */
+  struct tt_wall wall;
+  struct head_sync *sync;
+  uint64_t start, end;
+  pthread_t tid;
+};
+
+/* Wait until all n heads arrived and return whether every one of them
+ * passed ok, so that either all heads stop after a frame or none does. */
+static bool head_sync(struct head_sync *s, bool ok) {
+  bool result;
+
+  pthread_mutex_lock(&s->lock);
+  s->ok &= ok;
+  if (++s->arrived == s->n) {
+    s->result = s->ok;
+    s->ok = true;
+    s->arrived = 0;
+    s->generation++;
+    pthread_cond_broadcast(&s->cond);
+  } else {
+    unsigned long generation = s->generation;
+
+    while (generation == s->generation)
+      pthread_cond_wait(&s->cond, &s->lock);
+  }
+  result = s->result;
+  pthread_mutex_unlock(&s->lock);
+  return result;
+}
+
+static bool head_frame(struct head *h) {
+  if (h->wall.cells)
+    return tt_wall_frame(&h->wall, h->dev);
+  return tt_anim_frame(&h->anim, h->dev);
+}
+
+static int flip(struct drm_dev *dev) {
+  int ret;
+
+  perfctr_begin();
+  ret = flip_buffer(dev);
+  perfctr_mark(PERF_FLIP);
+  return ret;
+}
+
+static void *head_main(void *data) {
+  struct head *h = data;
+  bool ok = true;
+
+  h->start = now_ns();
+  for (;;) {
+    ok = ok && head_frame(h);
+    if (!head_sync(h->sync, ok))
+      break;
+    ok = !flip(h->dev);
+  }
+  h->end = now_ns();
+  return NULL;
+}
+
+static void run_threaded(struct head *heads, unsigned int n) {
+  struct head_sync sync = {.n = n, .ok = true};
+  unsigned int started;
+
+  pthread_mutex_init(&sync.lock, NULL);
+  pthread_cond_init(&sync.cond, NULL);
+
+  /* hold the lock so no head can count on all n before n is final */
+  pthread_mutex_lock(&sync.lock);
+  /* the calling thread drives head 0 */
+  for (started = 1; started < n; started++) {
+    heads[started].sync = &sync;
+    if (pthread_create(&heads[started].tid, NULL, head_main,
+                       &heads[started])) {
+      ERROR("cannot start thread for head %u, driving %u heads\n", started,
+            started);
+      break;
+    }
+  }
+  /* heads that did not get a thread are left dark */
+  sync.n = started;
+  pthread_mutex_unlock(&sync.lock);
+  heads[0].sync = &sync;
+  head_main(&heads[0]);
+  for (unsigned int i = 1; i < started; i++)
+    pthread_join(heads[i].tid, NULL);
+
+  pthread_cond_destroy(&sync.cond);
+  pthread_mutex_destroy(&sync.lock);
+}
+
+static void run_lockstep(struct head *heads, unsigned int n) {
+  bool ok = true;
+  uint64_t start = now_ns();
+
+  while (ok) {
+    for (unsigned int i = 0; i < n && ok; i++)
+      ok = head_frame(&heads[i]);
+    for (unsigned int i = 0; i < n && ok; i++)
+      ok = !flip(heads[i].dev);
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    heads[i].start = start;
+    heads[i].end = now_ns();
+  }
+}
+
+int heads_run(struct drm_manager *drm, const struct heads_config *cfg) {
+  bool threaded = cfg->threaded;
+  unsigned int threads = cfg->threads;
+  struct worker_pool *shared = NULL;
+  struct head *heads;
+  unsigned int n = 0, i = 0;
+  int ret = 0;
+
+  for (drm_dev_list *iter = drm->devs; iter; iter = iter->next)
+    n++;
+  if (!n)
+    return -ENODEV;
+  heads = calloc(n, sizeof(*heads));
+  if (!heads)
+    return -ENOMEM;
+
+  if (!threaded && threads > 1)
+    shared = worker_pool_create(threads);
+  for (drm_dev_list *iter = drm->devs; iter; iter = iter->next, i++) {
+    struct drm_dev *dev = iter->dev;
+    vec2 cpos;
+
+    /* the buffers may be smaller than the mode, see drm_manager.scale */
+    cpos.x = dev->bufs[0].width / 2;
+    cpos.y = dev->bufs[0].height / 2;
+    heads[i].dev = dev;
+    if (cfg->wall_cols) {
+      ret = tt_wall_init(&heads[i].wall, dev->bufs[0].width,
+                         dev->bufs[0].height, cfg->wall_cols, cfg->wall_rows,
+                         cfg->max_points, time(NULL) + i);
+      if (ret) {
+        ERROR("cannot set up a %ux%u wall for connector %u\n",
+              cfg->wall_cols, cfg->wall_rows, dev->conn_id);
+        n = i + 1;
+        goto out;
+      }
+    } else if (tt_anim_init(&heads[i].anim, cpos, cpos.y - 10,
+                            cfg->max_points)) {
+      ERROR("cannot set up animation for connector %u\n", dev->conn_id);
+      n = i + 1;
+      ret = -ENOMEM;
+      goto out;
+    }
+    tt_anim_govern(&heads[i].anim, cfg->budget_ns);
+    if (cfg->play) {
+      if (cfg->play->hdr->width != dev->bufs[0].width ||
+          cfg->play->hdr->height != dev->bufs[0].height)
+        ERROR("display list of %ux%u played on %ux%u, frames are clipped\n",
+              cfg->play->hdr->width, cfg->play->hdr->height,
+              dev->bufs[0].width, dev->bufs[0].height);
+      tt_anim_play(&heads[i].anim, cfg->play);
+    }
+    if (cfg->record && !i)
+      tt_anim_record(&heads[i].anim, cfg->record);
+    dev->pool = threaded && threads > 1 ? worker_pool_create(threads) : shared;
+  }
+
+  if (threaded && n > 1)
+    run_threaded(heads, n);
+  else
+    run_lockstep(heads, n);
+
+  for (i = 0; i < n; i++) {
+    struct drm_dev *dev = heads[i].dev;
+    double secs = (heads[i].end - heads[i].start) / 1e9;
+
+    if (heads[i].wall.cells) {
+      LOG("%s %ux%u: %zu frames in %.3f s (%.1f fps), %u figures, %zu "
+          "points\n",
+          dev->backend->name, dev->bufs[0].width, dev->bufs[0].height,
+          heads[i].wall.frames, secs, heads[i].wall.frames / secs,
+          heads[i].wall.cols * heads[i].wall.rows,
+          tt_wall_points(&heads[i].wall));
+      continue;
+    }
+    LOG("%s %ux%u: %zu frames in %.3f s (%.1f fps), %zu points\n",
+        dev->backend->name, dev->bufs[0].width, dev->bufs[0].height,
+        heads[i].anim.frames, secs, heads[i].anim.frames / secs,
+        heads[i].anim.geo.max_points);
+  }
+
+out:
+  for (i = 0; i < n; i++) {
+    if (heads[i].dev->pool != shared)
+      worker_pool_destroy(heads[i].dev->pool);
+    heads[i].dev->pool = NULL;
+    tt_anim_free(&heads[i].anim);
+    tt_wall_free(&heads[i].wall);
+  }
+  worker_pool_destroy(shared);
+  free(heads);
+  return ret;
+}
+
+/* frames rendered to estimate the cost of a resolution, spread over the
+ * whole animation since later frames have longer chords */
+#define COST_FRAMES 8
+
+/* Estimate how long rendering a frame at width x height takes, by drawing
+ * into a headless buffer. arg points to the rasteriser thread count. */
+uint64_t heads_render_cost(struct drm_manager *drm, uint32_t width,
+                           uint32_t height, void *arg) {
+  unsigned int threads = arg ? *(unsigned int *)arg : 1;
+  struct tt_geometry geo = {0};
+  struct drm_dev dev;
+  uint64_t worst = 0;
+  vec2 pos = {width / 2, height / 2};
+
+  if (headless_setup_dev(&dev, width, height, drm->format, 2, false))
+    return UINT64_MAX;
+  if (threads > 1)
+    dev.pool = worker_pool_create(threads);
+  if (tt_geometry_update(&geo, pos, pos.y - 10, HEADS_POINTS)) {
+    worst = UINT64_MAX;
+    goto out;
+  }
+  /* the first frame also faults the buffer in, it does not count */
+  for (int i = -1; i < COST_FRAMES; i++) {
+    uint32_t step = 2 * TT_STEP_ONE + (uint64_t)198 * TT_STEP_ONE *
+                                          (i < 0 ? 0 : i) / (COST_FRAMES - 1);
+    uint64_t start = now_ns(), took;
+
+    draw_tt_frame(&dev, &geo, step, (color){255, 255, 255});
+    took = now_ns() - start;
+    if (i >= 0 && took > worst)
+      worst = took;
+  }
+
+out:
+  tt_geometry_free(&geo);
+  drm_dev_teardown(&dev);
+  return worst;
+}
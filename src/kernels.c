@@ -0,0 +1,326 @@
+/*
+ * Pixel Kernels.
+ * Vectorised fill and copy loops for SSE2 and AVX2 on x86 and NEON on ARM,
+ * with a portable C fallback. The implementation is chosen at runtime from
+ * the CPU features, DRM_TT_KERNELS=<name> overrides the choice.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include <kernels.h>
+#include <utils.h>
+
+/* below this many bytes per row vector setup does not pay off */
+#define VEC_MIN_LEN 64
+
+/* store the first len (< 4 per call in the tails) bytes of the pattern */
+static inline void fill_tail(uint8_t *dst, size_t len, uint32_t pattern) {
+  memcpy(dst, &pattern, len);
+}
+
+static void fill_c(uint8_t *dst, size_t stride, size_t len, size_t h,
+                   uint32_t pattern, bool stream) {
+  (void)stream;
+  for (size_t y = 0; y < h; y++, dst += stride) {
+    uint8_t *p = dst;
+    size_t n = len;
+    /* memset is as fast as it gets for byte-uniform patterns */
+    if (((pattern ^ (pattern >> 8)) & 0xffffff) == 0) {
+      memset(p, pattern & 0xff, n);
+      continue;
+    }
+    for (; n >= 4; n -= 4, p += 4)
+      memcpy(p, &pattern, 4);
+    fill_tail(p, n, pattern);
+  }
+}
+
+static void copy_c(uint8_t *dst, size_t dst_stride, const uint8_t *src,
+                   size_t src_stride, size_t len, size_t h, bool stream) {
+  (void)stream;
+  for (size_t y = 0; y < h; y++, dst += dst_stride, src += src_stride)
+    memcpy(dst, src, len);
+}
+
+/* rotate the pattern so it continues correctly n bytes further on */
+static inline uint32_t pattern_skip(uint32_t pattern, size_t n) {
+  unsigned int sh = (n & 3) * 8;
+  return sh ? (pattern >> sh) | (pattern << (32 - sh)) : pattern;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2"))) static void
+fill_sse2(uint8_t *dst, size_t stride, size_t len, size_t h, uint32_t pattern,
+          bool stream) {
+  if (len < VEC_MIN_LEN) {
+    fill_c(dst, stride, len, h, pattern, stream);
+    return;
+  }
+  for (size_t y = 0; y < h; y++, dst += stride) {
+    uint8_t *p = dst;
+    size_t n = len;
+    size_t head = (16 - ((uintptr_t)p & 15)) & 15;
+    fill_c(p, 0, head, 1, pattern, false);
+    p += head;
+    n -= head;
+    __m128i v = _mm_set1_epi32(pattern_skip(pattern, head));
+    if (stream) {
+      for (; n >= 64; n -= 64, p += 64) {
+        _mm_stream_si128((__m128i *)p, v);
+        _mm_stream_si128((__m128i *)(p + 16), v);
+        _mm_stream_si128((__m128i *)(p + 32), v);
+        _mm_stream_si128((__m128i *)(p + 48), v);
+      }
+    }
+    for (; n >= 16; n -= 16, p += 16)
+      _mm_store_si128((__m128i *)p, v);
+    fill_c(p, 0, n, 1, pattern_skip(pattern, head), false);
+  }
+  if (stream)
+    _mm_sfence();
+}
+
+__attribute__((target("sse2"))) static void
+copy_sse2(uint8_t *dst, size_t dst_stride, const uint8_t *src,
+          size_t src_stride, size_t len, size_t h, bool stream) {
+  if (!stream || len < VEC_MIN_LEN) {
+    copy_c(dst, dst_stride, src, src_stride, len, h, stream);
+    return;
+  }
+  for (size_t y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t n = len;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+      __m128i a = _mm_loadu_si128((const __m128i *)s);
+      __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+      __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+      __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+      _mm_stream_si128((__m128i *)d, a);
+      _mm_stream_si128((__m128i *)(d + 16), b);
+      _mm_stream_si128((__m128i *)(d + 32), c);
+      _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    for (; n >= 16; n -= 16, d += 16, s += 16)
+      _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    memcpy(d, s, n);
+  }
+  _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static void
+fill_avx2(uint8_t *dst, size_t stride, size_t len, size_t h, uint32_t pattern,
+          bool stream) {
+  if (len < VEC_MIN_LEN) {
+    fill_c(dst, stride, len, h, pattern, stream);
+    return;
+  }
+  for (size_t y = 0; y < h; y++, dst += stride) {
+    uint8_t *p = dst;
+    size_t n = len;
+    size_t head = (32 - ((uintptr_t)p & 31)) & 31;
+    fill_c(p, 0, head, 1, pattern, false);
+    p += head;
+    n -= head;
+    __m256i v = _mm256_set1_epi32(pattern_skip(pattern, head));
+    if (stream) {
+      for (; n >= 128; n -= 128, p += 128) {
+        _mm256_stream_si256((__m256i *)p, v);
+        _mm256_stream_si256((__m256i *)(p + 32), v);
+        _mm256_stream_si256((__m256i *)(p + 64), v);
+        _mm256_stream_si256((__m256i *)(p + 96), v);
+      }
+    }
+    for (; n >= 32; n -= 32, p += 32)
+      _mm256_store_si256((__m256i *)p, v);
+    fill_c(p, 0, n, 1, pattern_skip(pattern, head), false);
+  }
+  if (stream)
+    _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static void
+copy_avx2(uint8_t *dst, size_t dst_stride, const uint8_t *src,
+          size_t src_stride, size_t len, size_t h, bool stream) {
+  if (!stream || len < VEC_MIN_LEN) {
+    copy_c(dst, dst_stride, src, src_stride, len, h, stream);
+    return;
+  }
+  for (size_t y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t n = len;
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)s);
+      __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+      _mm256_stream_si256((__m256i *)d, a);
+      _mm256_stream_si256((__m256i *)(d + 32), b);
+    }
+    for (; n >= 32; n -= 32, d += 32, s += 32)
+      _mm256_stream_si256((__m256i *)d,
+                          _mm256_loadu_si256((const __m256i *)s));
+    memcpy(d, s, n);
+  }
+  _mm_sfence();
+}
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_NEON
+/* AArch64 has a non-temporal pair store, 32-bit ARM only plain stores */
+static inline void store2_nt(uint8_t *p, uint32x4_t a, uint32x4_t b) {
+#ifdef __aarch64__
+  __asm__ volatile("stnp %q1, %q2, [%0]" : : "r"(p), "w"(a), "w"(b) : "memory");
+#else
+  vst1q_u32((uint32_t *)p, a);
+  vst1q_u32((uint32_t *)(p + 16), b);
+#endif
+}
+
+static void fill_neon(uint8_t *dst, size_t stride, size_t len, size_t h,
+                      uint32_t pattern, bool stream) {
+  if (len < VEC_MIN_LEN) {
+    fill_c(dst, stride, len, h, pattern, stream);
+    return;
+  }
+  for (size_t y = 0; y < h; y++, dst += stride) {
+    uint8_t *p = dst;
+    size_t n = len;
+    size_t head = (16 - ((uintptr_t)p & 15)) & 15;
+    fill_c(p, 0, head, 1, pattern, false);
+    p += head;
+    n -= head;
+    uint32x4_t v = vdupq_n_u32(pattern_skip(pattern, head));
+    if (stream) {
+      for (; n >= 64; n -= 64, p += 64) {
+        store2_nt(p, v, v);
+        store2_nt(p + 32, v, v);
+      }
+    }
+    for (; n >= 16; n -= 16, p += 16)
+      vst1q_u32((uint32_t *)p, v);
+    fill_c(p, 0, n, 1, pattern_skip(pattern, head), false);
+  }
+}
+
+static void copy_neon(uint8_t *dst, size_t dst_stride, const uint8_t *src,
+                      size_t src_stride, size_t len, size_t h, bool stream) {
+  if (!stream || len < VEC_MIN_LEN) {
+    copy_c(dst, dst_stride, src, src_stride, len, h, stream);
+    return;
+  }
+  for (size_t y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t n = len;
+    for (; n >= 32; n -= 32, d += 32, s += 32)
+      store2_nt(d, vld1q_u32((const uint32_t *)s),
+                vld1q_u32((const uint32_t *)(s + 16)));
+    memcpy(d, s, n);
+  }
+}
+#endif /* HAVE_NEON */
+
+/* ordered from worst to best */
+static const struct pixel_kernels all_kernels[] = {
+    {"c", fill_c, copy_c},
+#ifdef HAVE_X86
+    {"sse2", fill_sse2, copy_sse2},
+    {"avx2", fill_avx2, copy_avx2},
+#endif
+#ifdef HAVE_NEON
+    {"neon", fill_neon, copy_neon},
+#endif
+};
+#define NUM_KERNELS (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static bool cpu_supports(const struct pixel_kernels *k) {
+#ifdef HAVE_X86
+  if (!strcmp(k->name, "sse2"))
+    return __builtin_cpu_supports("sse2");
+  if (!strcmp(k->name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+#endif
+#if defined(HAVE_NEON) && !defined(__aarch64__)
+  if (!strcmp(k->name, "neon"))
+    return getauxval(AT_HWCAP) & HWCAP_NEON;
+#endif
+  (void)k;
+  return true;
+}
+
+/* Band workers and the capture writer may make the first call to kernels()
+ * at the same time, so the default is picked once and published with a
+ * single store; nobody sees a set that was not chosen. */
+static const struct pixel_kernels *_Atomic active;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+/* the set DRM_TT_KERNELS names, the best the CPU can run without it */
+static void select_default(void) {
+  const char *name = getenv("DRM_TT_KERNELS");
+  const struct pixel_kernels *best = NULL;
+
+  if (name && !kernels_select(name))
+    return;
+  for (size_t i = 0; i < NUM_KERNELS; i++)
+    if (cpu_supports(&all_kernels[i]))
+      best = &all_kernels[i];
+  atomic_store(&active, best);
+}
+
+const struct pixel_kernels *kernels(void) {
+  const struct pixel_kernels *k = atomic_load(&active);
+
+  if (k)
+    return k;
+  pthread_once(&default_once, select_default);
+  return atomic_load(&active);
+}
+
+/* switch to the named kernel set, fails if the CPU cannot run it */
+int kernels_select(const char *name) {
+  for (size_t i = 0; i < NUM_KERNELS; i++) {
+    if (!strcmp(all_kernels[i].name, name) && cpu_supports(&all_kernels[i])) {
+      atomic_store(&active, &all_kernels[i]);
+      return 0;
+    }
+  }
+  ERROR("pixel kernels '%s' not available\n", name);
+  return -1;
+}
+
+/* list the kernel sets this CPU can run */
+size_t kernels_available(const struct pixel_kernels **list, size_t max) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < NUM_KERNELS && n < max; i++)
+    if (cpu_supports(&all_kernels[i]))
+      list[n++] = &all_kernels[i];
+  return n;
+}
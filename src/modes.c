@@ -0,0 +1,141 @@
+/*
+ * Display Mode Selection.
+ * drm_manager.mode_spec picks the mode of every connector:
+ *
+ *   NULL          the first mode the connector lists, normally its native one
+ *   NAME          the mode of that name, e.g. "1280x720"
+ *   WxH[@HZ]      the first mode of that size, refreshing at HZ if given
+ *   auto          the mode with the highest pixel rate whose frame the
+ *                 renderer finishes within MODE_BUDGET_PERCENT of a refresh
+ *
+ * "auto" asks drm_manager.render_cost how long a frame of each size takes
+ * and falls back to the lowest pixel rate if no mode fits.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <modes.h>
+#include <utils.h>
+
+/* Duration of one refresh cycle of the mode in ns, 0 if unknown */
+uint64_t mode_period_ns(const drmModeModeInfo *m) {
+  if (!m->clock)
+    return 0;
+  /* the pixel clock is in kHz */
+  return (uint64_t)m->htotal * m->vtotal * 1000000ull / m->clock;
+}
+
+/* same timings, whatever the name and type flags say */
+bool mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b) {
+  return a->clock == b->clock && a->hdisplay == b->hdisplay &&
+         a->hsync_start == b->hsync_start && a->hsync_end == b->hsync_end &&
+         a->htotal == b->htotal && a->hskew == b->hskew &&
+         a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+         a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+         a->vscan == b->vscan && a->flags == b->flags;
+}
+
+static uint64_t pixel_rate(const drmModeModeInfo *m) {
+  return (uint64_t)m->hdisplay * m->vdisplay * m->vrefresh;
+}
+
+/* interlaced and double scan modes do not flip once per vblank */
+static bool progressive(const drmModeModeInfo *m) {
+  return !(m->flags & (DRM_MODE_FLAG_INTERLACE | DRM_MODE_FLAG_DBLSCAN));
+}
+
+static int match_spec(const drmModeConnector *conn, const char *spec) {
+  unsigned int w, h, hz = 0;
+  char at;
+  int n;
+
+  for (int i = 0; i < conn->count_modes; i++)
+    if (!strcmp(conn->modes[i].name, spec))
+      return i;
+
+  n = sscanf(spec, "%ux%u%c%u", &w, &h, &at, &hz);
+  if (n != 2 && !(n == 4 && at == '@'))
+    return -1;
+  for (int i = 0; i < conn->count_modes; i++) {
+    const drmModeModeInfo *m = &conn->modes[i];
+
+    if (m->hdisplay == w && m->vdisplay == h && (!hz || m->vrefresh == hz) &&
+        progressive(m))
+      return i;
+  }
+  return -1;
+}
+
+struct cost_cache {
+  uint16_t w, h;
+  uint64_t ns;
+};
+
+static int pick_auto(struct drm_manager *drm, const drmModeConnector *conn) {
+  /* frames are rendered at the scaled down size */
+  unsigned int scale = drm->scale > 1 ? drm->scale : 1;
+  struct cost_cache *costs;
+  size_t ncosts = 0;
+  int best = -1, lowest = -1;
+
+  costs = calloc(conn->count_modes, sizeof(*costs));
+  if (!costs)
+    return -1;
+  for (int i = 0; i < conn->count_modes; i++) {
+    const drmModeModeInfo *m = &conn->modes[i];
+    uint64_t budget = mode_period_ns(m) * MODE_BUDGET_PERCENT / 100, cost;
+    size_t c;
+
+    if (!progressive(m) || !budget)
+      continue;
+    if (lowest < 0 || pixel_rate(m) < pixel_rate(&conn->modes[lowest]))
+      lowest = i;
+    if (best >= 0 && pixel_rate(m) <= pixel_rate(&conn->modes[best]))
+      continue;
+
+    /* modes often share a size at several refresh rates */
+    for (c = 0; c < ncosts; c++)
+      if (costs[c].w == m->hdisplay && costs[c].h == m->vdisplay)
+        break;
+    if (c == ncosts) {
+      costs[c].w = m->hdisplay;
+      costs[c].h = m->vdisplay;
+      costs[c].ns = drm->render_cost(drm, m->hdisplay / scale,
+                                     m->vdisplay / scale, drm->render_cost_arg);
+      ncosts++;
+    }
+    cost = costs[c].ns;
+    LOG("mode %s@%u: frame takes %.2f ms of %.2f ms budget\n", m->name,
+        m->vrefresh, cost / 1e6, budget / 1e6);
+    if (cost <= budget)
+      best = i;
+  }
+  free(costs);
+  return best >= 0 ? best : lowest;
+}
+
+/* Choose the mode for conn according to drm->mode_spec */
+int mode_pick(struct drm_manager *drm, const drmModeConnector *conn,
+              drmModeModeInfo *mode) {
+  const char *spec = drm->mode_spec;
+  int i;
+
+  if (!spec)
+    i = 0;
+  else if (!strcmp(spec, "auto") && drm->render_cost)
+    i = pick_auto(drm, conn);
+  else
+    i = match_spec(conn, spec);
+
+  if (i < 0) {
+    fprintf(stderr, "no mode \"%s\" on connector %u\n", spec,
+            conn->connector_id);
+    return -EINVAL;
+  }
+  memcpy(mode, &conn->modes[i], sizeof(*mode));
+  return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Hardware Performance Counters.
+ * Counts cycles, instructions, last level cache misses, dTLB misses and
+ * branch mispredictions per stage of a frame with perf_event_open, to tell
+ * why a frame is slow and not just that it is. Every thread that draws
+ * opens a counter group of its own on first use, so the band workers are
+ * counted too; the totals of all threads are reported at exit.
+ *
+ * The counters of a group are read together with one read, user space
+ * only, so perf_event_paranoid up to 2 allows them. Where the kernel or
+ * the CPU (or a VM) offers no hardware counters at all, perfctr_enable
+ * fails and everything stays a no-op. Counters that only some CPUs have
+ * are left out and reported as missing.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <perfctr.h>
+#include <utils.h>
+
+enum perf_event {
+  EV_CYCLES,
+  EV_INSTRUCTIONS,
+  EV_LLC_MISSES,
+  EV_DTLB_MISSES,
+  EV_BRANCH_MISSES,
+  NUM_EVENTS
+};
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} events[NUM_EVENTS] = {
+    [EV_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [EV_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                         PERF_COUNT_HW_INSTRUCTIONS},
+    [EV_LLC_MISSES] = {"LLC misses", PERF_TYPE_HARDWARE,
+                       PERF_COUNT_HW_CACHE_MISSES},
+    [EV_DTLB_MISSES] = {"dTLB misses", PERF_TYPE_HW_CACHE,
+                        PERF_COUNT_HW_CACHE_DTLB |
+                            PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                            PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    [EV_BRANCH_MISSES] = {"branch misses", PERF_TYPE_HARDWARE,
+                          PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const char *stage_names[PERF_STAGES] = {
+    [PERF_SETUP] = "setup", [PERF_CLEAR] = "clear",
+    [PERF_ELLIPSE] = "ellipse", [PERF_LINES] = "lines",
+    [PERF_FLIP] = "flip",
+};
+
+/* the counter group of one thread */
+struct perf_thread {
+  struct perf_thread *next;
+  int fd[NUM_EVENTS];
+  /* position of each event in a group read, -1 if it could not be opened */
+  int slot[NUM_EVENTS];
+  unsigned int n;
+  uint64_t last[NUM_EVENTS];
+  uint64_t sum[PERF_STAGES][NUM_EVENTS];
+};
+
+bool perfctr_enabled;
+
+static __thread struct perf_thread *self;
+/* set for threads whose group could not be opened, so they do not retry */
+static __thread bool self_failed;
+static struct perf_thread *all;
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int perf_open(uint32_t type, uint64_t config, int group) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void thread_free(struct perf_thread *t) {
+  for (int e = 0; e < NUM_EVENTS; e++)
+    if (t->fd[e] >= 0)
+      close(t->fd[e]);
+  free(t);
+}
+
+/* Open the counter group of the calling thread. Only cycles are required,
+ * the other events are left out if the CPU does not have them. */
+static struct perf_thread *thread_open(void) {
+  struct perf_thread *t = calloc(1, sizeof(*t));
+
+  if (!t)
+    return NULL;
+  for (int e = 0; e < NUM_EVENTS; e++) {
+    t->fd[e] = perf_open(events[e].type, events[e].config,
+                         e == EV_CYCLES ? -1 : t->fd[EV_CYCLES]);
+    t->slot[e] = t->fd[e] >= 0 ? (int)t->n++ : -1;
+    if (e == EV_CYCLES && t->fd[e] < 0) {
+      int err = errno;
+
+      free(t);
+      errno = err;
+      return NULL;
+    }
+  }
+  ioctl(t->fd[EV_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+  pthread_mutex_lock(&all_lock);
+  t->next = all;
+  all = t;
+  pthread_mutex_unlock(&all_lock);
+  return t;
+}
+
+static bool thread_read(struct perf_thread *t, uint64_t *val) {
+  uint64_t buf[1 + NUM_EVENTS];
+
+  if (read(t->fd[EV_CYCLES], buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t) ||
+      buf[0] != t->n)
+    return false;
+  for (int e = 0; e < NUM_EVENTS; e++)
+    val[e] = t->slot[e] >= 0 ? buf[1 + t->slot[e]] : 0;
+  return true;
+}
+
+static struct perf_thread *thread_self(void) {
+  if (!self && !self_failed) {
+    self = thread_open();
+    self_failed = !self;
+  }
+  return self;
+}
+
+/* Check that hardware counters can be opened and turn the instrumentation
+ * on. Fails with a message if they cannot. */
+int perfctr_enable(void) {
+  struct perf_thread *t = thread_self();
+  int err = errno;
+
+  if (!t) {
+    ERROR("hardware counters unavailable (%m), not counting\n");
+    return -err;
+  }
+  for (int e = 0; e < NUM_EVENTS; e++)
+    if (t->slot[e] < 0)
+      ERROR("no %s counter on this CPU\n", events[e].name);
+  perfctr_enabled = true;
+  return 0;
+}
+
+void perfctr_snapshot(void) {
+  struct perf_thread *t = thread_self();
+
+  if (t)
+    thread_read(t, t->last);
+}
+
+void perfctr_account(enum perf_stage stage) {
+  struct perf_thread *t = self;
+  uint64_t now[NUM_EVENTS];
+
+  if (!t || !thread_read(t, now))
+    return;
+  for (int e = 0; e < NUM_EVENTS; e++) {
+    t->sum[stage][e] += now[e] - t->last[e];
+    t->last[e] = now[e];
+  }
+}
+
+/* per 1000 instructions, or - without the counter */
+static void print_rate(FILE *out, uint64_t n, uint64_t instructions,
+                       bool have) {
+  if (have && instructions)
+    fprintf(out, " %11.3f", 1000.0 * n / instructions);
+  else
+    fprintf(out, " %11s", "-");
+}
+
+/* Print the totals of all threads per stage to out and release the
+ * counters. Call once drawing has stopped. */
+void perfctr_report(FILE *out) {
+  uint64_t sum[PERF_STAGES][NUM_EVENTS] = {{0}};
+  bool have[NUM_EVENTS] = {false};
+  uint64_t cycles = 0;
+  unsigned int nthreads = 0;
+  struct perf_thread *t;
+
+  if (!perfctr_enabled)
+    return;
+  perfctr_enabled = false;
+  pthread_mutex_lock(&all_lock);
+  while ((t = all) != NULL) {
+    all = t->next;
+    for (int s = 0; s < PERF_STAGES; s++)
+      for (int e = 0; e < NUM_EVENTS; e++)
+        sum[s][e] += t->sum[s][e];
+    for (int e = 0; e < NUM_EVENTS; e++)
+      have[e] |= t->slot[e] >= 0;
+    nthreads++;
+    thread_free(t);
+  }
+  pthread_mutex_unlock(&all_lock);
+  /* other threads never look at theirs again with perfctr_enabled off */
+  self = NULL;
+
+  for (int s = 0; s < PERF_STAGES; s++)
+    cycles += sum[s][EV_CYCLES];
+  fprintf(out,
+          "hardware counters, %u threads, misses per 1000 instructions:\n",
+          nthreads);
+  fprintf(out, "  %-8s %14s %6s %6s %11s %11s %11s\n", "stage", "cycles",
+          "share", "IPC", "LLC", "dTLB", "branch");
+  for (int s = 0; s < PERF_STAGES; s++) {
+    uint64_t *v = sum[s];
+
+    if (!v[EV_CYCLES])
+      continue;
+    fprintf(out, "  %-8s %14llu %5.1f%%", stage_names[s],
+            (unsigned long long)v[EV_CYCLES], 100.0 * v[EV_CYCLES] / cycles);
+    if (have[EV_INSTRUCTIONS])
+      fprintf(out, " %6.2f", (double)v[EV_INSTRUCTIONS] / v[EV_CYCLES]);
+    else
+      fprintf(out, " %6s", "-");
+    print_rate(out, v[EV_LLC_MISSES], v[EV_INSTRUCTIONS],
+               have[EV_LLC_MISSES] && have[EV_INSTRUCTIONS]);
+    print_rate(out, v[EV_DTLB_MISSES], v[EV_INSTRUCTIONS],
+               have[EV_DTLB_MISSES] && have[EV_INSTRUCTIONS]);
+    print_rate(out, v[EV_BRANCH_MISSES], v[EV_INSTRUCTIONS],
+               have[EV_BRANCH_MISSES] && have[EV_INSTRUCTIONS]);
+    fprintf(out, "\n");
+  }
+}
@@ -0,0 +1,473 @@
+/*
+ * Line Rasteriser.
+ * Produces exactly the pixels of the Bresenham loop draw_line used to run,
+ * but clips the segment against the target once up front and then walks a
+ * pixel pointer instead of computing every address from (x, y).
+ *
+ * Along the major axis, with L = major and M = minor length (M <= L), that
+ * loop sets pixel k (0 <= k <= L) at minor offset
+ *
+ *   m(k) = floor((2kM + L) / 2L)
+ *
+ * which can be inverted to find the first and last k inside the clip
+ * rectangle. Lengths are kept below 2^30 for the 64-bit math by not drawing
+ * lines that reach beyond RASTER_COORD_MAX.
+ *
+ * Horizontal, vertical and diagonal lines need no error term: horizontal
+ * runs are filled as one block, vertical and diagonal ones step the pointer
+ * by a constant. Circles are walked over one octant and mirrored.
+ *
+ * Everything that stores pixels takes the pixel size as a constant and is
+ * inlined into one copy per size, so the inner loops never branch on the
+ * format.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kernels.h>
+#include <raster.h>
+
+#define SPECIALISED static inline __attribute__((always_inline))
+
+SPECIALISED void store(uint8_t *p, uint32_t pixel, unsigned int cpp) {
+  if (cpp == 2)
+    *(uint16_t *)p = pixel;
+  else
+    *(uint32_t *)p = pixel;
+}
+
+static inline int64_t div_floor(int64_t a, int64_t b) {
+  int64_t q = a / b;
+  return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+static inline int64_t div_ceil(int64_t a, int64_t b) {
+  return -div_floor(-a, b);
+}
+
+/* runs from this many pixels on go through the fill kernel */
+#define RUN_KERNEL_MIN 32
+
+/* n pixels from p on to the right */
+SPECIALISED void run(uint8_t *p, size_t n, uint32_t pixel, unsigned int cpp) {
+  if (n >= RUN_KERNEL_MIN) {
+    kernels()->fill(p, 0, n * cpp, 1, cpp == 2 ? pixel | pixel << 16 : pixel,
+                    false);
+    return;
+  }
+  for (size_t i = 0; i < n; i++, p += cpp)
+    store(p, pixel, cpp);
+}
+
+/* n pixels from p on, step bytes apart */
+SPECIALISED void stride_run(uint8_t *p, size_t n, ptrdiff_t step,
+                            uint32_t pixel, unsigned int cpp) {
+  for (size_t i = 0; i < n; i++, p += step)
+    store(p, pixel, cpp);
+}
+
+/* Step along k in [k0, k1] with the error term of the minor axis in d.
+ * d = (2kM + L) - 2m(k)L, so a minor step is due once d reaches 2L. */
+SPECIALISED void walk(uint8_t *p, int64_t k0, int64_t k1, int64_t d,
+                      int64_t L, int64_t M, ptrdiff_t major_step,
+                      ptrdiff_t minor_step, uint32_t pixel, unsigned int cpp) {
+  int64_t inc = 2 * M, wrap = 2 * L;
+
+  for (int64_t k = k0; k <= k1; k++) {
+    store(p, pixel, cpp);
+    p += major_step;
+    d += inc;
+    if (d >= wrap) {
+      d -= wrap;
+      p += minor_step;
+    }
+  }
+}
+
+/* Clip the segment from (u0, v0) along major axis u to [umin, umax] x
+ * [vmin, vmax], su/sv being the step directions. Returns false if nothing
+ * is left, the visible k range otherwise. */
+static bool clip_range(int64_t u0, int64_t v0, int64_t L, int64_t M, int su,
+                       int sv, int64_t umin, int64_t umax, int64_t vmin,
+                       int64_t vmax, int64_t *k0, int64_t *k1) {
+  int64_t lo = 0, hi = L, tlo, thi;
+
+  /* the major axis steps once per k */
+  if (su > 0) {
+    lo = umin - u0 > lo ? umin - u0 : lo;
+    hi = umax - u0 < hi ? umax - u0 : hi;
+  } else {
+    lo = u0 - umax > lo ? u0 - umax : lo;
+    hi = u0 - umin < hi ? u0 - umin : hi;
+  }
+
+  /* the minor offset m(k) has to stay within [tlo, thi] */
+  if (sv > 0) {
+    tlo = vmin - v0;
+    thi = vmax - v0;
+  } else {
+    tlo = v0 - vmax;
+    thi = v0 - vmin;
+  }
+  if (M == 0) {
+    if (tlo > 0 || thi < 0)
+      return false;
+  } else if (tlo > 0 || thi < M) {
+    /* m(k) >= t  <=>  2kM >= (2t - 1)L */
+    int64_t klo = div_ceil((2 * tlo - 1) * L, 2 * M);
+    /* m(k) <= t  <=>  2kM < (2t + 1)L */
+    int64_t khi = div_floor((2 * thi + 1) * L - 1, 2 * M);
+    lo = klo > lo ? klo : lo;
+    hi = khi < hi ? khi : hi;
+  }
+
+  *k0 = lo;
+  *k1 = hi;
+  return lo <= hi;
+}
+
+SPECIALISED void line(const struct raster_target *t, vec2 p0, vec2 p1,
+                      uint32_t pixel, unsigned int cpp) {
+  const struct drm_rect *c = &t->clip;
+  int64_t dx = llabs((int64_t)p1.x - p0.x), dy = llabs((int64_t)p1.y - p0.y);
+  int sx = p0.x < p1.x ? 1 : -1, sy = p0.y < p1.y ? 1 : -1;
+  int64_t L, M, k0, k1, m, d;
+  ptrdiff_t xstep = sx * (ptrdiff_t)cpp, ystep = sy * (ptrdiff_t)t->stride;
+  uint8_t *p;
+
+  if (!raster_coord_ok(p0) || !raster_coord_ok(p1))
+    return;
+  /* trivially outside */
+  if ((p0.x < c->x0 && p1.x < c->x0) || (p0.x >= c->x1 && p1.x >= c->x1) ||
+      (p0.y < c->y0 && p1.y < c->y0) || (p0.y >= c->y1 && p1.y >= c->y1) ||
+      drm_rect_empty(c))
+    return;
+
+  if (dx >= dy) {
+    /* x-major, also covers the single pixel case */
+    L = dx;
+    M = dy;
+    if (!clip_range(p0.x, p0.y, L, M, sx, sy, c->x0, c->x1 - 1, c->y0,
+                    c->y1 - 1, &k0, &k1))
+      return;
+  } else {
+    L = dy;
+    M = dx;
+    if (!clip_range(p0.y, p0.x, L, M, sy, sx, c->y0, c->y1 - 1, c->x0,
+                    c->x1 - 1, &k0, &k1))
+      return;
+  }
+
+  /* minor offset and error term at the first visible pixel */
+  if (L) {
+    m = (2 * k0 * M + L) / (2 * L);
+    d = 2 * k0 * M + L - 2 * m * L;
+  } else {
+    m = d = 0;
+  }
+
+  if (dx >= dy) {
+    p = t->map + (ptrdiff_t)(p0.y + sy * m) * t->stride +
+        (ptrdiff_t)(p0.x + sx * k0) * cpp;
+    if (M == 0)
+      /* fill left to right whichever way the line goes */
+      run(sx > 0 ? p : p - (k1 - k0) * cpp, k1 - k0 + 1, pixel, cpp);
+    else if (M == L)
+      stride_run(p, k1 - k0 + 1, xstep + ystep, pixel, cpp);
+    else
+      walk(p, k0, k1, d, L, M, xstep, ystep, pixel, cpp);
+  } else {
+    p = t->map + (ptrdiff_t)(p0.y + sy * k0) * t->stride +
+        (ptrdiff_t)(p0.x + sx * m) * cpp;
+    if (M == 0)
+      stride_run(p, k1 - k0 + 1, ystep, pixel, cpp);
+    else
+      walk(p, k0, k1, d, L, M, ystep, xstep, pixel, cpp);
+  }
+}
+
+void raster_line(const struct raster_target *t, vec2 p0, vec2 p1,
+                 uint32_t pixel) {
+  if (t->cpp == 2)
+    line(t, p0, p1, pixel, 2);
+  else
+    line(t, p0, p1, pixel, 4);
+}
+
+SPECIALISED void put_clipped(const struct raster_target *t, int x, int y,
+                             uint32_t pixel, unsigned int cpp) {
+  const struct drm_rect *c = &t->clip;
+
+  if (x < c->x0 || x >= c->x1 || y < c->y0 || y >= c->y1)
+    return;
+  store(t->map + (ptrdiff_t)y * t->stride + (ptrdiff_t)x * cpp, pixel, cpp);
+}
+
+void raster_point(const struct raster_target *t, int x, int y,
+                  uint32_t pixel) {
+  if (t->cpp == 2)
+    put_clipped(t, x, y, pixel, 2);
+  else
+    put_clipped(t, x, y, pixel, 4);
+}
+
+/* the 8 mirror images of (x, y) around the centre p */
+SPECIALISED void put8(uint8_t *p, ptrdiff_t stride, int x, int y,
+                      uint32_t pixel, unsigned int cpp) {
+  ptrdiff_t xc = x * (ptrdiff_t)cpp, yr = y * stride;
+  ptrdiff_t yc = y * (ptrdiff_t)cpp, xr = x * stride;
+
+  store(p + yr + xc, pixel, cpp);
+  store(p + yr - xc, pixel, cpp);
+  store(p - yr + xc, pixel, cpp);
+  store(p - yr - xc, pixel, cpp);
+  store(p + xr + yc, pixel, cpp);
+  store(p + xr - yc, pixel, cpp);
+  store(p - xr + yc, pixel, cpp);
+  store(p - xr - yc, pixel, cpp);
+}
+
+SPECIALISED void put8_clipped(const struct raster_target *t, vec2 c, int x,
+                              int y, uint32_t pixel, unsigned int cpp) {
+  put_clipped(t, c.x + x, c.y + y, pixel, cpp);
+  put_clipped(t, c.x - x, c.y + y, pixel, cpp);
+  put_clipped(t, c.x + x, c.y - y, pixel, cpp);
+  put_clipped(t, c.x - x, c.y - y, pixel, cpp);
+  put_clipped(t, c.x + y, c.y + x, pixel, cpp);
+  put_clipped(t, c.x - y, c.y + x, pixel, cpp);
+  put_clipped(t, c.x + y, c.y - x, pixel, cpp);
+  put_clipped(t, c.x - y, c.y - x, pixel, cpp);
+}
+
+/* The ellipse loop below for a == b. Its pixels are symmetric in x and y
+ * then, so walking the octant from the top to the diagonal and mirroring
+ * it eight ways sets the same pixels. All error terms are multiples of r^2,
+ * which is divided out. Circles fully inside the clip rectangle skip the
+ * per-pixel clip test. */
+SPECIALISED void circle(const struct raster_target *t, vec2 c, int r,
+                        uint32_t pixel, unsigned int cpp) {
+  const struct drm_rect *cl = &t->clip;
+  int x = 0, y = r;
+  int64_t err = 2 - 2 * (int64_t)r, e2;
+  uint8_t *p = NULL;
+
+  if ((int64_t)c.x - r >= cl->x0 && (int64_t)c.x + r < cl->x1 &&
+      (int64_t)c.y - r >= cl->y0 && (int64_t)c.y + r < cl->y1)
+    p = t->map + (ptrdiff_t)c.y * t->stride + (ptrdiff_t)c.x * cpp;
+  while (x <= y) {
+    if (p)
+      put8(p, t->stride, x, y, pixel, cpp);
+    else
+      put8_clipped(t, c, x, y, pixel, cpp);
+    e2 = 2 * err;
+    if (e2 < 2 * x + 1) {
+      x++;
+      err += 2 * x + 1;
+    }
+    if (e2 > -(2 * y - 1)) {
+      y--;
+      err -= 2 * y - 1;
+    }
+  }
+}
+
+/* Whether ellipse() and ellipse_spans() may be called for c, a and b at
+ * all: radii and centre in range and the bounding box touching the clip
+ * rectangle. */
+static bool ellipse_drawn(const struct raster_target *t, vec2 c, int a,
+                          int b) {
+  const struct drm_rect *cl = &t->clip;
+
+  return raster_ellipse_ok(c, a, b) && (int64_t)c.x + a >= cl->x0 &&
+         (int64_t)c.x - a < cl->x1 && (int64_t)c.y + b >= cl->y0 &&
+         (int64_t)c.y - b < cl->y1;
+}
+
+/* Bresenham Algorithm to draw an ellipse, pixels outside of the clip
+ * rectangle are skipped */
+SPECIALISED void ellipse(const struct raster_target *t, vec2 c, int a, int b,
+                         uint32_t pixel, unsigned int cpp) {
+  vec2 d;
+  d.x = 0;
+  d.y = b;
+  int64_t a2 = (int64_t)a * a, b2 = (int64_t)b * b;
+  int64_t err = b2 - (2 * (int64_t)b - 1) * a2, e2;
+
+  /* the loop below never ends for a point */
+  if (a == 0 && b == 0) {
+    put_clipped(t, c.x, c.y, pixel, cpp);
+    return;
+  }
+  if (a == b) {
+    circle(t, c, a, pixel, cpp);
+    return;
+  }
+  do {
+    put_clipped(t, c.x + d.x, c.y + d.y, pixel, cpp);
+    put_clipped(t, c.x - d.x, c.y + d.y, pixel, cpp);
+    put_clipped(t, c.x - d.x, c.y - d.y, pixel, cpp);
+    put_clipped(t, c.x + d.x, c.y - d.y, pixel, cpp);
+
+    e2 = 2 * err;
+    if (e2 < (2 * d.x + 1) * b2) {
+      d.x++;
+      err += (2 * d.x + 1) * b2;
+    }
+    if (e2 > -(2 * d.y - 1) * a2) {
+      d.y--;
+      err -= (2 * d.y - 1) * a2;
+    }
+  } while (d.y >= 0);
+
+  while (d.x++ < a) {
+    put_clipped(t, c.x + d.x, c.y, pixel, cpp);
+    put_clipped(t, c.x - d.x, c.y, pixel, cpp);
+  }
+}
+
+void raster_ellipse(const struct raster_target *t, vec2 c, int a, int b,
+                    uint32_t pixel) {
+  if (!ellipse_drawn(t, c, a, b))
+    return;
+  if (t->cpp == 2)
+    ellipse(t, c, a, b, pixel, 2);
+  else
+    ellipse(t, c, a, b, pixel, 4);
+}
+
+/* the pixels from c.x - w to c.x + w on row y, clipped */
+SPECIALISED void span(const struct raster_target *t, vec2 c, int w, int y,
+                      uint32_t pixel, unsigned int cpp) {
+  const struct drm_rect *cl = &t->clip;
+  int x0 = c.x - w < cl->x0 ? cl->x0 : c.x - w;
+  int x1 = c.x + w >= cl->x1 ? cl->x1 - 1 : c.x + w;
+
+  if (y < cl->y0 || y >= cl->y1 || x0 > x1)
+    return;
+  run(t->map + (ptrdiff_t)y * t->stride + (ptrdiff_t)x0 * cpp, x1 - x0 + 1,
+      pixel, cpp);
+}
+
+/* Everything on and inside the outline ellipse() draws, one span per row.
+ * The outline loop visits each row from b down to 1 in turn, and the x it
+ * reaches last on a row is the half width of that row's span. Rows outside
+ * the clip rectangle are skipped whole. */
+SPECIALISED void ellipse_spans(const struct raster_target *t, vec2 c, int a,
+                               int b, uint32_t pixel, unsigned int cpp) {
+  int x = 0, y = b, w;
+  int64_t a2 = (int64_t)a * a, b2 = (int64_t)b * b;
+  int64_t err = b2 - (2 * (int64_t)b - 1) * a2, e2;
+
+  while (y > 0) {
+    w = x;
+    e2 = 2 * err;
+    if (e2 < (2 * x + 1) * b2) {
+      x++;
+      err += (2 * x + 1) * b2;
+    }
+    if (e2 > -(2 * y - 1) * a2) {
+      span(t, c, w, c.y - y, pixel, cpp);
+      span(t, c, w, c.y + y, pixel, cpp);
+      y--;
+      err -= (2 * y - 1) * a2;
+    }
+  }
+  /* the outline finishes the middle row out to a */
+  span(t, c, a, c.y, pixel, cpp);
+}
+
+void raster_fill_ellipse(const struct raster_target *t, vec2 c, int a, int b,
+                         uint32_t pixel) {
+  if (!ellipse_drawn(t, c, a, b))
+    return;
+  if (t->cpp == 2)
+    ellipse_spans(t, c, a, b, pixel, 2);
+  else
+    ellipse_spans(t, c, a, b, pixel, 4);
+}
+
+/* Sort the segments into the bands of t they cover (counting sort). */
+int raster_bin_segments(struct raster_bins *b, const struct raster_target *t,
+                        const segment *segs, size_t n, uint32_t band_rows) {
+  const struct drm_rect *c = &t->clip;
+  uint32_t nbands = (c->y1 - c->y0 + band_rows - 1) / band_rows;
+  size_t total = 0;
+
+  if (drm_rect_empty(c))
+    nbands = 0;
+  if (nbands + 1 > b->cap_bands) {
+    uint32_t *start = realloc(b->start, (nbands + 1) * sizeof(*start));
+    if (!start)
+      return -ENOMEM;
+    b->start = start;
+    b->cap_bands = nbands + 1;
+  }
+  b->band_rows = band_rows;
+  b->nbands = nbands;
+  memset(b->start, 0, (nbands + 1) * sizeof(*b->start));
+
+#define SEG_BANDS(s, first, last)                                              \
+  int ylo = (s)->p0.y < (s)->p1.y ? (s)->p0.y : (s)->p1.y;                     \
+  int yhi = (s)->p0.y < (s)->p1.y ? (s)->p1.y : (s)->p0.y;                     \
+  if (yhi < c->y0 || ylo >= c->y1)                                             \
+    continue;                                                                  \
+  first = ((ylo < c->y0 ? c->y0 : ylo) - c->y0) / band_rows;                   \
+  last = ((yhi >= c->y1 ? c->y1 - 1 : yhi) - c->y0) / band_rows
+
+  /* count references per band, shifted by one for the prefix sum */
+  for (size_t i = 0; i < n; i++) {
+    uint32_t first, last;
+    SEG_BANDS(&segs[i], first, last);
+    for (uint32_t band = first; band <= last; band++)
+      b->start[band + 1]++;
+    total += last - first + 1;
+  }
+  if (total > b->cap_idx) {
+    uint32_t *idx = realloc(b->idx, total * sizeof(*idx));
+    if (!idx)
+      return -ENOMEM;
+    b->idx = idx;
+    b->cap_idx = total;
+  }
+  for (uint32_t band = 0; band < nbands; band++)
+    b->start[band + 1] += b->start[band];
+
+  /* fill, using start[band] as cursor and restoring it afterwards */
+  for (size_t i = 0; i < n; i++) {
+    uint32_t first, last;
+    SEG_BANDS(&segs[i], first, last);
+    for (uint32_t band = first; band <= last; band++)
+      b->idx[b->start[band]++] = i;
+  }
+#undef SEG_BANDS
+  for (uint32_t band = nbands; band > 0; band--)
+    b->start[band] = b->start[band - 1];
+  b->start[0] = 0;
+  return 0;
+}
+
+/* Rasterise the binned segments that cross one band, clipped to it. */
+void raster_band_lines(const struct raster_target *t,
+                       const struct raster_bins *b, uint32_t band,
+                       const segment *segs, uint32_t pixel) {
+  struct raster_target bt = *t;
+
+  bt.clip.y0 = t->clip.y0 + band * b->band_rows;
+  if (bt.clip.y0 + (int32_t)b->band_rows < bt.clip.y1)
+    bt.clip.y1 = bt.clip.y0 + b->band_rows;
+  for (uint32_t i = b->start[band]; i < b->start[band + 1]; i++) {
+    const segment *s = &segs[b->idx[i]];
+    if (t->cpp == 2)
+      line(&bt, s->p0, s->p1, pixel, 2);
+    else
+      line(&bt, s->p0, s->p1, pixel, 4);
+  }
+}
+
+void raster_bins_free(struct raster_bins *b) {
+  free(b->start);
+  free(b->idx);
+  memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,60 @@
+/*
+ * Shadow Framebuffer.
+ * Dumb buffers are usually mapped write-combined or uncached, where the
+ * scattered pixel stores of the rasteriser are slow. In shadow mode drawing
+ * goes to a normal heap buffer instead and only the rectangle that changed
+ * is copied into the back buffer, with streaming stores, right before the
+ * flip.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <format.h>
+#include <kernels.h>
+#include <shadow.h>
+#include <utils.h>
+
+int shadow_enable(struct drm_dev *dev) {
+  struct drm_buf *buf = &dev->bufs[0];
+  size_t size = ((size_t)buf->stride * buf->height + 63) & ~(size_t)63;
+
+  if (dev->shadow)
+    return 0;
+  dev->shadow = aligned_alloc(64, size);
+  if (!dev->shadow)
+    return -ENOMEM;
+  memset(dev->shadow, 0, size);
+  /* the buffers keep their damage, the first uploads clear it */
+  memset(&dev->dirty, 0, sizeof(dev->dirty));
+  return 0;
+}
+
+void shadow_disable(struct drm_dev *dev) {
+  free(dev->shadow);
+  dev->shadow = NULL;
+}
+
+/* copy rectangle r between two buffers of the same layout */
+void shadow_copy_rect(uint8_t *dst, const uint8_t *src, uint32_t stride,
+                      uint32_t cpp, const struct drm_rect *r) {
+  size_t off = (size_t)r->y0 * stride + r->x0 * cpp;
+
+  if (drm_rect_empty(r))
+    return;
+  kernels()->copy(dst + off, stride, src + off, stride, (r->x1 - r->x0) * cpp,
+                  r->y1 - r->y0, true);
+}
+
+/* Bring the back buffer up to date with the shadow. Besides what was drawn
+ * now, whatever the buffer showed the last time has to be overwritten too. */
+void shadow_upload(struct drm_dev *dev) {
+  struct drm_buf *back = drm_back_buf(dev);
+  struct drm_rect r = back->damage;
+
+  drm_rect_union(&r, &dev->dirty);
+  shadow_copy_rect(back->map, dev->shadow, back->stride, dev->format->cpp,
+                   &r);
+  back->damage = dev->dirty;
+}
@@ -0,0 +1,256 @@
+/*
+ * Frame Telemetry.
+ * The render thread of a device pushes one record per frame once it is on
+ * screen. Records go into a ring that keeps the last capacity frames, so
+ * other threads may read them while rendering goes on, and into histograms
+ * covering the whole run for the summary.
+ *
+ * The histograms are log-linear: 16 buckets per power of two, which keeps
+ * any percentile within about 6% of the exact value.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <telemetry.h>
+#include <utils.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+  uint32_t count[HIST_BUCKETS];
+  uint64_t n;
+  uint64_t min, max, sum;
+};
+
+struct telemetry {
+  struct tm_frame *ring;
+  uint64_t mask;
+  /* frames pushed so far, the ring holds the last mask + 1 of them. The
+   * oldest of those is in the slot the next push writes, so readers only
+   * take the last mask. */
+  _Atomic uint64_t head;
+  /* duration of one refresh cycle, 0 if there is no display */
+  uint64_t period_ns;
+
+  /* only touched by the render thread */
+  uint64_t first_flip, last_flip;
+  uint64_t missed;
+  struct histogram render, latency;
+};
+
+static unsigned int hist_bucket(uint64_t v) {
+  unsigned int e;
+
+  if (v < HIST_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+         ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* upper bound of the values falling into bucket i */
+static uint64_t hist_value(unsigned int i) {
+  unsigned int e;
+
+  if (i < HIST_SUB)
+    return i;
+  e = i / HIST_SUB + HIST_SUB_BITS - 1;
+  return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_add(struct histogram *h, uint64_t v) {
+  if (!h->n || v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+  h->sum += v;
+  h->n++;
+  h->count[hist_bucket(v)]++;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p) {
+  uint64_t rank = p * (h->n - 1) / 100 + 1, seen = 0;
+
+  for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->count[i];
+    if (seen >= rank) {
+      uint64_t v = hist_value(i);
+      return v > h->max ? h->max : v < h->min ? h->min : v;
+    }
+  }
+  return h->max;
+}
+
+struct telemetry *telemetry_create(unsigned int capacity, uint64_t period_ns) {
+  struct telemetry *tm;
+  uint64_t size = 1;
+
+  /* one slot more than capacity for the push in progress */
+  while (size <= capacity)
+    size <<= 1;
+  tm = calloc(1, sizeof(*tm));
+  if (!tm)
+    return NULL;
+  tm->ring = calloc(size, sizeof(*tm->ring));
+  if (!tm->ring) {
+    free(tm);
+    return NULL;
+  }
+  tm->mask = size - 1;
+  tm->period_ns = period_ns;
+  return tm;
+}
+
+void telemetry_free(struct telemetry *tm) {
+  if (!tm)
+    return;
+  free(tm->ring);
+  free(tm);
+}
+
+/* Record a frame that went on screen. Only one thread may push. */
+void telemetry_push(struct telemetry *tm, uint64_t render_ns, uint64_t submit,
+                    uint64_t flip) {
+  uint64_t n = atomic_load_explicit(&tm->head, memory_order_relaxed);
+  struct tm_frame *f = &tm->ring[n & tm->mask];
+
+  /* a reader that sees any of the stores below also sees head at n */
+  atomic_thread_fence(memory_order_release);
+  f->render_ns = render_ns;
+  f->submit = submit;
+  f->flip = flip;
+  f->missed = 0;
+  /* a gap of k refresh cycles to the last flip skipped k - 1 of them */
+  if (n && tm->period_ns && flip > tm->last_flip) {
+    uint64_t cycles =
+        (flip - tm->last_flip + tm->period_ns / 2) / tm->period_ns;
+    if (cycles > 1)
+      f->missed = cycles - 1;
+  }
+  if (!n)
+    tm->first_flip = flip;
+  tm->last_flip = flip;
+  tm->missed += f->missed;
+  hist_add(&tm->render, render_ns);
+  hist_add(&tm->latency, flip > submit ? flip - submit : 0);
+
+  atomic_store_explicit(&tm->head, n + 1, memory_order_release);
+}
+
+/* Copy up to max records, starting at frame number from or the oldest one
+ * still in the ring, to out. The number of the first copied frame is stored
+ * in first. Safe to call while another thread pushes: records the pusher
+ * started to overwrite during the copy are dropped. */
+size_t telemetry_read(const struct telemetry *tm, uint64_t from,
+                      struct tm_frame *out, size_t max, uint64_t *first) {
+  uint64_t head = atomic_load_explicit(&tm->head, memory_order_acquire);
+  uint64_t oldest = head > tm->mask ? head - tm->mask : 0;
+  size_t n;
+
+  if (from < oldest)
+    from = oldest;
+  n = head > from ? head - from : 0;
+  if (n > max)
+    n = max;
+  for (size_t i = 0; i < n; i++)
+    out[i] = tm->ring[(from + i) & tm->mask];
+
+  /* The writer may have lapped the start of what was just copied. Frame
+   * head - mask - 1 shares its slot with the push that may be under way. */
+  atomic_thread_fence(memory_order_acquire);
+  head = atomic_load_explicit(&tm->head, memory_order_relaxed);
+  oldest = head > tm->mask ? head - tm->mask : 0;
+  if (oldest > from) {
+    uint64_t lost = oldest - from;
+
+    if (lost >= n)
+      lost = n;
+    memmove(out, out + lost, (n - lost) * sizeof(*out));
+    n -= lost;
+    from += lost;
+  }
+  *first = from;
+  return n;
+}
+
+static void report_hist(const char *what, const struct histogram *h) {
+  if (!h->n)
+    return;
+  ERROR("  %-8s min %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f  "
+        "mean %9.1f us\n",
+        what, h->min / 1e3, hist_percentile(h, 50) / 1e3,
+        hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+        h->max / 1e3, h->sum / 1e3 / h->n);
+}
+
+/* one line per power of two of the latency, scaled to 40 columns */
+static void report_buckets(const struct histogram *h) {
+  uint32_t octave[64 - HIST_SUB_BITS + 1] = {0}, top = 0;
+  unsigned int lo = 64, hi = 0;
+
+  for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+    unsigned int o = i / HIST_SUB;
+
+    if (!h->count[i])
+      continue;
+    octave[o] += h->count[i];
+    lo = o < lo ? o : lo;
+    hi = o > hi ? o : hi;
+  }
+  for (unsigned int o = lo; o <= hi; o++)
+    top = octave[o] > top ? octave[o] : top;
+  for (unsigned int o = lo; o <= hi && top; o++) {
+    int bar = (uint64_t)octave[o] * 40 / top;
+
+    ERROR("  < %9.1f us %8u %.*s\n",
+          (hist_value(o * HIST_SUB + HIST_SUB - 1) + 1) / 1e3, octave[o], bar,
+          "########################################");
+  }
+}
+
+void telemetry_report(const struct telemetry *tm, const char *name) {
+  uint64_t frames = atomic_load(&tm->head);
+  double secs = (tm->last_flip - tm->first_flip) / 1e9;
+
+  ERROR("%s: %llu frames", name, (unsigned long long)frames);
+  if (frames > 1 && secs > 0)
+    ERROR(", %.1f fps", (frames - 1) / secs);
+  if (tm->period_ns)
+    ERROR(", %llu missed vblanks at %.2f Hz",
+          (unsigned long long)tm->missed, 1e9 / tm->period_ns);
+  ERROR("\n");
+  report_hist("render", &tm->render);
+  report_hist("latency", &tm->latency);
+  if (tm->latency.n) {
+    ERROR("  submit to flip latency:\n");
+    report_buckets(&tm->latency);
+  }
+}
+
+int telemetry_dump_csv(const struct telemetry *tm, FILE *f, const char *name,
+                       bool header) {
+  struct tm_frame buf[256];
+  uint64_t from = 0, first;
+  size_t n;
+
+  if (header)
+    fprintf(f, "head,frame,render_us,submit_ns,flip_ns,latency_us,missed\n");
+  while ((n = telemetry_read(tm, from, buf, 256, &first))) {
+    for (size_t i = 0; i < n; i++) {
+      const struct tm_frame *r = &buf[i];
+
+      fprintf(f, "%s,%llu,%.3f,%llu,%llu,%.3f,%u\n", name,
+              (unsigned long long)(first + i), r->render_ns / 1e3,
+              (unsigned long long)r->submit, (unsigned long long)r->flip,
+              (r->flip > r->submit ? r->flip - r->submit : 0) / 1e3, r->missed);
+    }
+    from = first + n;
+  }
+  return ferror(f) ? -EIO : 0;
+}
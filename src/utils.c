@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include <utils.h>
 
@@ -28,3 +29,11 @@ void *emmap(int addr, size_t len, int prot, int flag, int fd, off_t offset) {
     error("mmap");
   return fp;
 }
+
+/* monotonic timestamp in nanoseconds, for frame timing */
+uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
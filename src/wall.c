@@ -0,0 +1,142 @@
+/*
+ * Video Wall.
+ * Many small timetables in a grid on one output. A frame is drawn one grid
+ * row at a time with draw_strips: every row is a strip of its own, so the
+ * worker pool splits the wall by rows and each thread clears, computes and
+ * draws the figures of its rows while they are in its cache. A figure costs
+ * its chord walk and rasterising, nothing per frame is allocated, sorted or
+ * shared between threads.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <draw.h>
+#include <format.h>
+#include <raster.h>
+#include <utils.h>
+#include <wall.h>
+
+/* gap between neighbouring figures */
+#define WALL_GAP 2
+/* cells too small for a circle of this radius are refused */
+#define WALL_MIN_RADIUS 8
+
+/* random value in [lo, hi] */
+static unsigned int wall_rand(unsigned int *seed, unsigned int lo,
+                              unsigned int hi) {
+  return lo + rand_r(seed) % (hi - lo + 1);
+}
+
+/* Lay out a grid of cols x rows figures over a width x height buffer. The
+ * figures vary from seed: radius 70 to 100% of what fits the cell, centre
+ * moved by what that leaves, up to max_points points but not many more
+ * than the circle has pixels, half to twice the pace of a single animation
+ * and a colour walk of their own. */
+int tt_wall_init(struct tt_wall *w, uint32_t width, uint32_t height,
+                 unsigned int cols, unsigned int rows, size_t max_points,
+                 uint32_t seed) {
+  unsigned int rnd = seed;
+  int fit;
+
+  memset(w, 0, sizeof(*w));
+  if (!cols || !rows)
+    return -EINVAL;
+  w->cell_w = width / cols;
+  w->cell_h = height / rows;
+  fit = (w->cell_w < w->cell_h ? w->cell_w : w->cell_h) / 2 - WALL_GAP;
+  if (fit < WALL_MIN_RADIUS)
+    return -EINVAL;
+  w->cols = cols;
+  w->rows = rows;
+  w->area.x0 = (width - cols * w->cell_w) / 2;
+  w->area.y0 = (height - rows * w->cell_h) / 2;
+  w->area.x1 = w->area.x0 + cols * w->cell_w;
+  w->area.y1 = w->area.y0 + rows * w->cell_h;
+  w->max_frames = (TT_STEP_LAST - TT_STEP_FIRST) / TT_STEP_INC + 1;
+  w->cells = calloc((size_t)cols * rows, sizeof(*w->cells));
+  if (!w->cells)
+    return -ENOMEM;
+
+  for (unsigned int i = 0; i < cols * rows; i++) {
+    struct tt_anim *a = &w->cells[i];
+    int r = fit * (int)wall_rand(&rnd, 70, 100) / 100;
+    int slack = fit - r;
+    size_t points = 4 * (size_t)r;
+    vec2 pos;
+
+    if (points > max_points)
+      points = max_points;
+    if (points > TT_POINTS_MIN)
+      points = wall_rand(&rnd, (points + TT_POINTS_MIN) / 2, points);
+    pos.x = w->area.x0 + (int)(i % cols) * w->cell_w + w->cell_w / 2 +
+            (int)wall_rand(&rnd, 0, 2 * slack) - slack;
+    pos.y = w->area.y0 + (int)(i / cols) * w->cell_h + w->cell_h / 2 +
+            (int)wall_rand(&rnd, 0, 2 * slack) - slack;
+    if (tt_anim_init(a, pos, r, points)) {
+      tt_wall_free(w);
+      return -ENOMEM;
+    }
+    a->step_inc = wall_rand(&rnd, TT_STEP_INC / 2, 2 * TT_STEP_INC);
+    a->step = wall_rand(&rnd, TT_STEP_FIRST, TT_STEP_LAST);
+    tt_anim_seed(a, rand_r(&rnd));
+  }
+  return 0;
+}
+
+/* Draw and advance the figures of grid row row. Every figure lies within
+ * its row, so the strip clip never cuts one. */
+static void wall_row(void *arg, const struct raster_target *t,
+                     unsigned int row) {
+  struct tt_wall *w = arg;
+  struct tt_anim *a = &w->cells[(size_t)row * w->cols];
+
+  for (unsigned int i = 0; i < w->cols; i++, a++) {
+    struct tt_geometry *geo = &a->geo;
+    uint32_t pixel;
+
+    tt_anim_next_color(a);
+    pixel = w->format->pack(a->c);
+    tt_geometry_chords(geo, a->step);
+    raster_ellipse(t, geo->pos, geo->r, geo->r, pixel);
+    for (size_t j = 0; j < geo->max_points; j++)
+      raster_line(t, geo->segs[j].p0, geo->segs[j].p1, pixel);
+    a->step += a->step_inc;
+    if (a->step > TT_STEP_LAST)
+      a->step = TT_STEP_FIRST;
+    a->frames++;
+  }
+}
+
+/* Render the next frame of the wall into the back buffer of dev, like
+ * tt_anim_frame */
+bool tt_wall_frame(struct tt_wall *w, struct drm_dev *dev) {
+  uint64_t start;
+
+  if (w->frames >= w->max_frames || wait_buffer(dev))
+    return false;
+  start = now_ns();
+  w->format = dev->format;
+  draw_strips(dev, &w->area, w->cell_h, wall_row, w);
+  dev->render_ns = now_ns() - start;
+  w->frames++;
+  return true;
+}
+
+/* lines drawn per frame, over all figures */
+size_t tt_wall_points(const struct tt_wall *w) {
+  size_t n = 0;
+
+  for (unsigned int i = 0; i < w->cols * w->rows; i++)
+    n += w->cells[i].geo.max_points;
+  return n;
+}
+
+void tt_wall_free(struct tt_wall *w) {
+  if (w->cells)
+    for (unsigned int i = 0; i < w->cols * w->rows; i++)
+      tt_anim_free(&w->cells[i]);
+  free(w->cells);
+  w->cells = NULL;
+}
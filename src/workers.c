@@ -0,0 +1,139 @@
+/*
+ * Worker Pool.
+ * worker_pool_run hands out the indices 0..n-1 of a job one at a time to
+ * whichever thread asks next, so uneven work per index balances itself.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <utils.h>
+#include <workers.h>
+
+struct worker_pool {
+  unsigned int threads;
+  pthread_t *tids;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  /* bumped for every job, workers wait for it to change */
+  unsigned long generation;
+  unsigned int busy;
+  bool quit;
+
+  worker_fn fn;
+  void *arg;
+  unsigned int n;
+  atomic_uint next;
+};
+
+static void run_items(struct worker_pool *pool) {
+  unsigned int i;
+
+  while ((i = atomic_fetch_add(&pool->next, 1)) < pool->n)
+    pool->fn(pool->arg, i);
+}
+
+static void *worker_main(void *data) {
+  struct worker_pool *pool = data;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == seen && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->quit)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_items(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct worker_pool *worker_pool_create(unsigned int threads) {
+  struct worker_pool *pool;
+
+  if (threads == 0)
+    threads = 1;
+  pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+  pool->tids = calloc(threads, sizeof(*pool->tids));
+  if (!pool->tids) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  /* the caller is thread 0 */
+  pool->threads = 1;
+  for (unsigned int t = 1; t < threads; t++) {
+    if (pthread_create(&pool->tids[t], NULL, worker_main, pool)) {
+      ERROR("cannot start worker thread, using %u\n", pool->threads);
+      break;
+    }
+    pool->threads++;
+  }
+  return pool;
+}
+
+void worker_pool_destroy(struct worker_pool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (unsigned int t = 1; t < pool->threads; t++)
+    pthread_join(pool->tids[t], NULL);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->tids);
+  free(pool);
+}
+
+unsigned int worker_pool_threads(const struct worker_pool *pool) {
+  return pool ? pool->threads : 1;
+}
+
+/* Run fn(arg, i) for every i < n and return once all calls finished.
+ * Not reentrant: one job per pool at a time. */
+void worker_pool_run(struct worker_pool *pool, worker_fn fn, void *arg,
+                     unsigned int n) {
+  if (!pool || pool->threads == 1 || n == 1) {
+    for (unsigned int i = 0; i < n; i++)
+      fn(arg, i);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->n = n;
+  atomic_store(&pool->next, 0);
+  pool->busy = pool->threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_items(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
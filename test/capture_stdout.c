@@ -0,0 +1,80 @@
+/*
+ * Capture To Stdout Test.
+ * Runs drm_timetables headless with -c - and checks that what arrives on
+ * stdout is a y4m stream and nothing else: the header, then whole frames up
+ * to the end. Any message on stdout breaks an encoder reading the pipe.
+ *
+ * usage: capture_stdout path/to/drm_timetables
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include <utils.h>
+
+#define WIDTH 64
+#define HEIGHT 48
+
+int main(int argc, char **argv) {
+  char cmd[4096], line[128];
+  unsigned int width, height;
+  unsigned long frames = 0;
+  size_t size;
+  uint8_t *frame;
+  FILE *f;
+  int status;
+
+  if (argc != 2) {
+    ERROR("usage: %s drm_timetables\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  snprintf(cmd, sizeof(cmd), "'%s' -H %ux%u -c - 2>/dev/null", argv[1],
+           WIDTH, HEIGHT);
+  f = popen(cmd, "r");
+  if (!f) {
+    ERROR("cannot run %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  if (!fgets(line, sizeof(line), f) ||
+      sscanf(line, "YUV4MPEG2 W%u H%u ", &width, &height) != 2 ||
+      width != WIDTH || height != HEIGHT) {
+    ERROR("FAIL no y4m header for %ux%u on stdout\n", WIDTH, HEIGHT);
+    pclose(f);
+    return EXIT_FAILURE;
+  }
+  size = (size_t)width * height * 3;
+  frame = malloc(size);
+  if (!frame)
+    return EXIT_FAILURE;
+
+  for (;;) {
+    size_t n = fread(line, 1, 6, f);
+
+    if (!n)
+      break;
+    if (n != 6 || memcmp(line, "FRAME\n", 6)) {
+      ERROR("FAIL after frame %lu: '%.*s' instead of a frame header\n",
+            frames, (int)n, line);
+      pclose(f);
+      return EXIT_FAILURE;
+    }
+    if (fread(frame, 1, size, f) != size) {
+      ERROR("FAIL frame %lu is truncated\n", frames);
+      pclose(f);
+      return EXIT_FAILURE;
+    }
+    frames++;
+  }
+  free(frame);
+  status = pclose(f);
+  if (!frames || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    ERROR("FAIL %lu frames, exit status %d\n", frames, status);
+    return EXIT_FAILURE;
+  }
+  LOG("%lu frames, nothing else on stdout\n", frames);
+  return EXIT_SUCCESS;
+}
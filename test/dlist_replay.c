@@ -0,0 +1,157 @@
+/*
+ * Display List Replay Test.
+ * Records frames of known content and plays them back: once from a list
+ * completed with dlist_finish, once from one whose recorder died before
+ * that. The second has no frame count in its header and may end in a
+ * partly written record; it has to play every frame that made it to the
+ * file, unchanged, and stop cleanly at the cut. Lists with a frame the
+ * rasteriser cannot take, an end point or centre beyond RASTER_COORD_MAX or
+ * a negative radius, have to stop right before it.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <dlist.h>
+#include <raster.h>
+#include <utils.h>
+
+/* well past the writer's stdio buffer, so a part of them reaches the file
+ * before the recorder dies */
+#define FRAMES 2000
+#define SEGS 200
+/* the frame damaged in the lists that have to stop early */
+#define BAD_FRAME 700
+
+enum damage { DAMAGE_NONE, DAMAGE_SEGMENT, DAMAGE_CENTER, DAMAGE_RADIUS };
+
+/* the content of frame i */
+static void make_frame(unsigned int i, segment *segs, size_t *n, color *c) {
+  *n = 1 + i % SEGS;
+  for (size_t j = 0; j < *n; j++) {
+    segs[j].p0 = (vec2){(int)(i + j), (int)j};
+    segs[j].p1 = (vec2){(int)j, (int)(i * 3 + j)};
+  }
+  *c = (color){i & 0xff, (i >> 8) & 0xff, 7};
+}
+
+static void record(const char *path, bool finish, enum damage damage) {
+  struct dlist_writer *w = dlist_create(path, 640, 480);
+  segment segs[SEGS];
+  size_t n;
+  color c;
+
+  if (!w)
+    exit(EXIT_FAILURE);
+  for (unsigned int i = 0; i < FRAMES; i++) {
+    vec2 center = {i, 2 * i};
+    int a = i % 50;
+
+    make_frame(i, segs, &n, &c);
+    if (i == BAD_FRAME && damage == DAMAGE_SEGMENT)
+      segs[n - 1].p1.y = INT_MIN;
+    if (i == BAD_FRAME && damage == DAMAGE_CENTER)
+      center.x = RASTER_COORD_MAX + 1;
+    if (i == BAD_FRAME && damage == DAMAGE_RADIUS)
+      a = -1;
+    if (dlist_write(w, c, center, a, i % 30, segs, n))
+      exit(EXIT_FAILURE);
+  }
+  if (finish)
+    dlist_finish(w);
+  else
+    /* dies with the rest of the stdio buffer unwritten */
+    _exit(EXIT_SUCCESS);
+}
+
+/* Play path and compare every frame; returns the number played or -1 */
+static long play(const char *path) {
+  const struct dlist_frame *f = NULL;
+  segment segs[SEGS];
+  struct dlist dl;
+  long frames = 0;
+  size_t n;
+  color c;
+
+  if (dlist_open(&dl, path)) {
+    ERROR("FAIL cannot open %s\n", path);
+    return -1;
+  }
+  while ((f = dlist_next(&dl, f))) {
+    color fc = dlist_color(f);
+
+    make_frame(frames, segs, &n, &c);
+    if (frames >= FRAMES || f->nsegs != n || f->a != frames % 50 ||
+        f->b != frames % 30 || f->c.x != frames || f->c.y != 2 * frames ||
+        memcmp(&fc, &c, sizeof(c)) ||
+        memcmp(dlist_segs(f), segs, n * sizeof(*segs))) {
+      ERROR("FAIL %s: frame %ld differs from what was recorded\n", path,
+            frames);
+      dlist_close(&dl);
+      return -1;
+    }
+    frames++;
+  }
+  dlist_close(&dl);
+  return frames;
+}
+
+int main(void) {
+  char finished[] = "/tmp/dlist-finished-XXXXXX";
+  char cut[] = "/tmp/dlist-cut-XXXXXX";
+  long played;
+  pid_t pid;
+  int fd, status, ret = EXIT_FAILURE;
+
+  if ((fd = mkstemp(finished)) < 0)
+    return EXIT_FAILURE;
+  close(fd);
+  if ((fd = mkstemp(cut)) < 0)
+    goto out_finished;
+  close(fd);
+
+  record(finished, true, DAMAGE_NONE);
+  played = play(finished);
+  if (played != FRAMES) {
+    ERROR("FAIL finished list: %ld of %d frames played\n", played, FRAMES);
+    goto out;
+  }
+
+  for (enum damage d = DAMAGE_SEGMENT; d <= DAMAGE_RADIUS; d++) {
+    record(finished, true, d);
+    played = play(finished);
+    if (played != BAD_FRAME) {
+      ERROR("FAIL damaged list %d: %ld frames played, not %d\n", d, played,
+            BAD_FRAME);
+      goto out;
+    }
+  }
+
+  pid = fork();
+  if (pid < 0)
+    goto out;
+  if (!pid)
+    record(cut, false, DAMAGE_NONE);
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status))
+    goto out;
+  played = play(cut);
+  if (played <= 0 || played >= FRAMES) {
+    ERROR("FAIL unfinished list: %ld of %d frames played\n", played, FRAMES);
+    goto out;
+  }
+  LOG("finished list: %d frames, unfinished list: %ld frames\n", FRAMES,
+      played);
+  ret = EXIT_SUCCESS;
+
+out:
+  unlink(cut);
+out_finished:
+  unlink(finished);
+  return ret;
+}
@@ -0,0 +1,470 @@
+/*
+ * Golden Image Test.
+ * Renders the same scenes with the optimised drawing paths and with the
+ * reference rasteriser and compares them pixel by pixel. Every scene runs
+ * on every combination of pixel kernels, pixel format, rasteriser threads
+ * and shadow buffer, with lines and ellipses reaching past the buffer edges
+ * so clipping is exercised too. Timetable frames are compared as presented
+ * after flip_buffer, which covers damage-tracked clearing and the shadow
+ * upload.
+ *
+ * All randomness is seeded, so a failure reproduces. On a mismatch the
+ * expected and actual image and a diff (mismatches in red) are written as
+ * PPM into $GOLDEN_OUT, or the working directory without it.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <draw.h>
+#include <format.h>
+#include <headless.h>
+#include <kernels.h>
+#include <raster.h>
+#include <shadow.h>
+#include <utils.h>
+#include <wall.h>
+#include <workers.h>
+
+#include "reference.h"
+
+/* odd sizes, so rows have padding and bands a ragged end */
+#define WIDTH 317
+#define HEIGHT 229
+#define SCENE_LINES 400
+#define SCENE_ELLIPSES 40
+#define SCENE_FILLED 20
+#define TT_FRAMES 12
+#define ANIM_FRAMES 40
+#define ANIM_SEED 1234
+/* a grid that leaves a ragged row below it and columns beside it */
+#define WALL_COLS 6
+#define WALL_ROWS 4
+#define WALL_FRAMES 12
+#define WALL_SEED 99
+
+struct config {
+  const struct pixel_kernels *kernels;
+  const struct pixel_format *format;
+  unsigned int threads;
+  bool shadow;
+  unsigned int nbufs;
+  char name[64];
+};
+
+struct golden {
+  struct config cfg;
+  struct drm_dev dev;
+  struct ref_canvas ref;
+  unsigned int failed;
+  unsigned int checked;
+  /* colours of the seeded animation in the first config, to compare the
+   * others against */
+  color anim_colors[ANIM_FRAMES];
+  bool have_colors;
+};
+
+static uint32_t seed;
+
+static int rnd(int n) {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % n;
+}
+
+static color rnd_color(void) {
+  return (color){rnd(255) + 1, rnd(255) + 1, rnd(255) + 1};
+}
+
+/* a point up to a quarter of the buffer outside of it */
+static vec2 rnd_point(void) {
+  return (vec2){rnd(WIDTH * 3 / 2) - WIDTH / 4,
+                rnd(HEIGHT * 3 / 2) - HEIGHT / 4};
+}
+
+/* Random segments, a quarter each of them horizontal, vertical, diagonal
+ * and any direction */
+static void rnd_segments(segment *segs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    int d = rnd(WIDTH) - WIDTH / 2;
+
+    segs[i].p0 = rnd_point();
+    switch (i % 4) {
+    case 0:
+      segs[i].p1 = (vec2){segs[i].p0.x + d, segs[i].p0.y};
+      break;
+    case 1:
+      segs[i].p1 = (vec2){segs[i].p0.x, segs[i].p0.y + d};
+      break;
+    case 2:
+      segs[i].p1 = (vec2){segs[i].p0.x + d, segs[i].p0.y + (i & 4 ? d : -d)};
+      break;
+    default:
+      segs[i].p1 = rnd_point();
+    }
+  }
+}
+
+static uint8_t *target_map(struct drm_dev *dev) {
+  return dev->shadow ? dev->shadow : drm_back_buf(dev)->map;
+}
+
+/* start a scene on a black buffer */
+static void reset(struct golden *g) {
+  struct drm_buf *back;
+
+  wait_buffer(&g->dev);
+  back = drm_back_buf(&g->dev);
+  g->dev.dirty = (struct drm_rect){0, 0, back->width, back->height};
+  clear(&g->dev);
+  ref_clear(&g->ref);
+}
+
+static uint32_t pixel_at(const uint8_t *map, uint32_t stride, uint32_t cpp,
+                         uint32_t x, uint32_t y) {
+  const uint8_t *p = map + (size_t)y * stride + (size_t)x * cpp;
+
+  return cpp == 2 ? *(const uint16_t *)p : *(const uint32_t *)p;
+}
+
+static void write_ppm(const struct golden *g, const char *scene,
+                      const char *kind, const uint8_t *map,
+                      const uint8_t *other) {
+  const struct pixel_format *f = g->cfg.format;
+  const char *dir = getenv("GOLDEN_OUT");
+  char path[256];
+  FILE *out;
+
+  snprintf(path, sizeof(path), "%s/golden-%s-%s-%s.ppm", dir ? dir : ".",
+           g->cfg.name, scene, kind);
+  out = fopen(path, "wb");
+  if (!out) {
+    ERROR("cannot write %s\n", path);
+    return;
+  }
+  fprintf(out, "P6\n%u %u\n255\n", WIDTH, HEIGHT);
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      uint32_t p = pixel_at(map, g->ref.stride, f->cpp, x, y);
+      color c = f->unpack(p);
+      uint8_t rgb[3] = {c.r, c.g, c.b};
+
+      if (other) {
+        bool differ = p != pixel_at(other, g->ref.stride, f->cpp, x, y);
+        /* the expected image dimmed, mismatches in full red */
+        rgb[0] = differ ? 255 : c.r / 4;
+        rgb[1] = differ ? 0 : c.g / 4;
+        rgb[2] = differ ? 0 : c.b / 4;
+      }
+      fwrite(rgb, 1, 3, out);
+    }
+  }
+  fclose(out);
+  ERROR("  wrote %s\n", path);
+}
+
+/* Compare map, laid out like the reference canvas, with the reference */
+static bool check(struct golden *g, const char *scene, const uint8_t *map) {
+  uint32_t cpp = g->ref.cpp, stride = g->ref.stride;
+  uint32_t bad = 0, fx = 0, fy = 0;
+
+  g->checked++;
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    if (!memcmp(map + (size_t)y * stride, g->ref.map + (size_t)y * stride,
+                WIDTH * cpp))
+      continue;
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      if (pixel_at(map, stride, cpp, x, y) ==
+          pixel_at(g->ref.map, stride, cpp, x, y))
+        continue;
+      if (!bad++) {
+        fx = x;
+        fy = y;
+      }
+    }
+  }
+  if (!bad)
+    return true;
+
+  ERROR("FAIL %s %s: %u pixels differ, first at %u,%u: %#x, expected %#x\n",
+        g->cfg.name, scene, bad, fx, fy, pixel_at(map, stride, cpp, fx, fy),
+        pixel_at(g->ref.map, stride, cpp, fx, fy));
+  /* one set of images per config and scene is enough to debug */
+  write_ppm(g, scene, "expected", g->ref.map, NULL);
+  write_ppm(g, scene, "actual", map, NULL);
+  write_ppm(g, scene, "diff", g->ref.map, map);
+  g->failed++;
+  return false;
+}
+
+static uint32_t pack(struct golden *g, color c) {
+  return g->cfg.format->pack(c);
+}
+
+static void scene_lines(struct golden *g) {
+  segment segs[SCENE_LINES];
+  color c;
+
+  seed = 1;
+  c = rnd_color();
+  rnd_segments(segs, SCENE_LINES);
+
+  /* one by one */
+  reset(g);
+  for (size_t i = 0; i < SCENE_LINES; i++) {
+    draw_line(&g->dev, segs[i].p0, segs[i].p1, c);
+    ref_line(&g->ref, segs[i].p0, segs[i].p1, pack(g, c));
+  }
+  check(g, "lines", target_map(&g->dev));
+
+  /* as a batch, binned into bands and maybe spread over threads */
+  reset(g);
+  draw_lines(&g->dev, segs, SCENE_LINES, c);
+  for (size_t i = 0; i < SCENE_LINES; i++)
+    ref_line(&g->ref, segs[i].p0, segs[i].p1, pack(g, c));
+  check(g, "batch", target_map(&g->dev));
+}
+
+/* a coordinate beyond RASTER_COORD_MAX, up to the ends of int */
+static int rnd_far(void) {
+  static const int far[] = {INT_MIN, -RASTER_COORD_MAX - 1,
+                            RASTER_COORD_MAX + 1, INT_MAX};
+
+  return far[rnd(4)];
+}
+
+/* Lines with an end point beyond RASTER_COORD_MAX are not drawn, however
+ * much of them would cross the buffer, and nothing wraps around into it.
+ * Both paths get them, one by one and binned. The same goes for ellipses
+ * with a centre that far out or a radius that is negative or above
+ * RASTER_RADIUS_MAX. */
+static void scene_far(struct golden *g) {
+  segment segs[SCENE_LINES];
+
+  seed = 5;
+  for (size_t i = 0; i < SCENE_LINES; i++) {
+    segs[i].p0 = rnd_point();
+    segs[i].p1 = i & 1 ? (vec2){rnd_far(), rnd(HEIGHT)}
+                       : (vec2){rnd(WIDTH), rnd_far()};
+    if (i & 2)
+      segs[i].p0 = (vec2){rnd_far(), rnd_far()};
+  }
+  reset(g);
+  for (size_t i = 0; i < SCENE_LINES; i++)
+    draw_line(&g->dev, segs[i].p0, segs[i].p1, rnd_color());
+  draw_lines(&g->dev, segs, SCENE_LINES, rnd_color());
+  for (int i = 0; i < SCENE_FILLED; i++) {
+    static const int radius[] = {-1, INT_MIN, RASTER_RADIUS_MAX + 1,
+                                 INT_MAX};
+    vec2 m = i & 1 ? (vec2){rnd_far(), rnd(HEIGHT)}
+                   : (vec2){rnd(WIDTH), rnd_far()};
+    int a = radius[rnd(4)], b = i & 2 ? a : rnd(HEIGHT / 2);
+
+    draw_ellipse(&g->dev, m, rnd(WIDTH), rnd(HEIGHT), rnd_color());
+    fill_ellipse(&g->dev, m, rnd(WIDTH), rnd(HEIGHT), rnd_color());
+    draw_ellipse(&g->dev, rnd_point(), a, b, rnd_color());
+    fill_ellipse(&g->dev, rnd_point(), b, a, rnd_color());
+  }
+  check(g, "far", target_map(&g->dev));
+}
+
+static void scene_ellipses(struct golden *g) {
+  reset(g);
+  seed = 2;
+  for (int i = 0; i < SCENE_ELLIPSES; i++) {
+    vec2 m = rnd_point();
+    int a = rnd(HEIGHT / 2);
+    /* half of them circles */
+    int b = i & 1 ? a : rnd(HEIGHT / 2);
+    color c = rnd_color();
+
+    draw_ellipse(&g->dev, m, a, b, c);
+    ref_ellipse(&g->ref, m, a, b, pack(g, c));
+  }
+  check(g, "ellipses", target_map(&g->dev));
+
+  reset(g);
+  for (int i = 0; i < SCENE_FILLED; i++) {
+    vec2 m = rnd_point();
+    int a = rnd(HEIGHT / 3);
+    int b = i & 1 ? a : rnd(HEIGHT / 3);
+    color c = rnd_color();
+
+    fill_ellipse(&g->dev, m, a, b, c);
+    ref_fill_ellipse(&g->ref, m, a, b, pack(g, c));
+  }
+  check(g, "filled", target_map(&g->dev));
+}
+
+/* the frame on screen after flip_buffer */
+static const uint8_t *presented(struct golden *g) {
+  return g->dev.bufs[g->dev.front_buf].map;
+}
+
+/* Timetable frames spread over the whole animation, one after another on
+ * the swapchain, so each is cleared from what the buffer held before */
+static void scene_tt(struct golden *g) {
+  struct tt_geometry geo = {0};
+  vec2 pos = {WIDTH / 2, HEIGHT / 2};
+  size_t counts[2] = {200, 37};
+
+  reset(g);
+  seed = 3;
+  for (size_t n = 0; n < 2; n++) {
+    if (tt_geometry_update(&geo, pos, pos.y - 10, counts[n]))
+      abort();
+    for (int i = 0; i < TT_FRAMES; i++) {
+      uint32_t step = 2 * TT_STEP_ONE +
+                      (uint64_t)198 * TT_STEP_ONE * i / (TT_FRAMES - 1) +
+                      rnd(TT_STEP_ONE);
+      color c = rnd_color();
+      char scene[32];
+
+      wait_buffer(&g->dev);
+      draw_tt_frame(&g->dev, &geo, step, c);
+      if (flip_buffer(&g->dev))
+        abort();
+      ref_tt_frame(&g->ref, pos, pos.y - 10, counts[n], step, pack(g, c));
+      snprintf(scene, sizeof(scene), "tt%zu-%d", counts[n], i);
+      if (!check(g, scene, presented(g)))
+        break;
+    }
+  }
+  tt_geometry_free(&geo);
+}
+
+/* The animation as draw_tt runs it, with a seeded colour walk. The colours
+ * have to be the same in every config. */
+static void scene_anim(struct golden *g) {
+  struct tt_anim anim;
+  vec2 pos = {WIDTH / 2, HEIGHT / 2};
+
+  reset(g);
+  if (tt_anim_init(&anim, pos, pos.y - 10, 200))
+    abort();
+  tt_anim_seed(&anim, ANIM_SEED);
+  for (int i = 0; i < ANIM_FRAMES; i++) {
+    uint32_t step = anim.step;
+    char scene[32];
+
+    if (!tt_anim_frame(&anim, &g->dev) || flip_buffer(&g->dev))
+      abort();
+    ref_tt_frame(&g->ref, pos, pos.y - 10, 200, step, pack(g, anim.c));
+    snprintf(scene, sizeof(scene), "anim-%d", i);
+    if (!g->have_colors)
+      g->anim_colors[i] = anim.c;
+    if (memcmp(&g->anim_colors[i], &anim.c, sizeof(anim.c))) {
+      ERROR("FAIL %s %s: colour walk differs for the same seed\n",
+            g->cfg.name, scene);
+      g->failed++;
+      break;
+    }
+    if (!check(g, scene, presented(g)))
+      break;
+  }
+  g->have_colors = true;
+  tt_anim_free(&anim);
+}
+
+/* A video wall after a line over the whole buffer, so the rows outside the
+ * grid need clearing too. Every figure is drawn by the reference with the
+ * step it was at before the frame and the colour it has after. */
+static void scene_wall(struct golden *g) {
+  struct tt_wall w;
+  uint32_t steps[WALL_COLS * WALL_ROWS];
+  vec2 corner = {WIDTH - 1, HEIGHT - 1};
+
+  reset(g);
+  if (tt_wall_init(&w, WIDTH, HEIGHT, WALL_COLS, WALL_ROWS, 60, WALL_SEED))
+    abort();
+  wait_buffer(&g->dev);
+  draw_line(&g->dev, (vec2){0, 0}, corner, (color){255, 255, 255});
+  if (flip_buffer(&g->dev))
+    abort();
+  for (int i = 0; i < WALL_FRAMES; i++) {
+    char scene[32];
+
+    for (int j = 0; j < WALL_COLS * WALL_ROWS; j++)
+      steps[j] = w.cells[j].step;
+    if (!tt_wall_frame(&w, &g->dev) || flip_buffer(&g->dev))
+      abort();
+    ref_clear(&g->ref);
+    for (int j = 0; j < WALL_COLS * WALL_ROWS; j++) {
+      struct tt_anim *a = &w.cells[j];
+
+      ref_tt_figure(&g->ref, a->geo.pos, a->geo.r, a->geo.max_points,
+                    steps[j], pack(g, a->c));
+    }
+    snprintf(scene, sizeof(scene), "wall-%d", i);
+    if (!check(g, scene, presented(g)))
+      break;
+  }
+  tt_wall_free(&w);
+}
+
+static int run_config(struct golden *g) {
+  struct config *cfg = &g->cfg;
+
+  snprintf(cfg->name, sizeof(cfg->name), "%s-%s-t%u%s", cfg->kernels->name,
+           cfg->format->name, cfg->threads, cfg->shadow ? "-shadow" : "");
+  if (kernels_select(cfg->kernels->name) ||
+      headless_setup_dev(&g->dev, WIDTH, HEIGHT, cfg->format, cfg->nbufs,
+                         false))
+    return -1;
+  if (cfg->shadow && shadow_enable(&g->dev))
+    return -1;
+  if (cfg->threads > 1)
+    g->dev.pool = worker_pool_create(cfg->threads);
+
+  g->ref.width = WIDTH;
+  g->ref.height = HEIGHT;
+  g->ref.cpp = cfg->format->cpp;
+  g->ref.stride = g->dev.bufs[0].stride;
+  g->ref.map = malloc((size_t)g->ref.stride * HEIGHT);
+  if (!g->ref.map)
+    return -1;
+
+  scene_lines(g);
+  scene_far(g);
+  scene_ellipses(g);
+  scene_tt(g);
+  scene_anim(g);
+  scene_wall(g);
+
+  free(g->ref.map);
+  drm_dev_teardown(&g->dev);
+  return 0;
+}
+
+int main(void) {
+  static struct golden g;
+  const struct pixel_format *formats[] = {&format_xrgb8888, &format_rgb565,
+                                          &format_xrgb2101010};
+  const struct pixel_kernels *ks[8];
+  size_t nks = kernels_available(ks, 8);
+
+  for (size_t k = 0; k < nks; k++) {
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+      for (unsigned int threads = 1; threads <= 3; threads += 2) {
+        for (int shadow = 0; shadow < 2; shadow++) {
+          g.cfg.kernels = ks[k];
+          g.cfg.format = formats[f];
+          g.cfg.threads = threads;
+          g.cfg.shadow = shadow;
+          /* vary the swapchain depth along with the rest */
+          g.cfg.nbufs = 2 + (k + f + shadow) % 2;
+          if (run_config(&g)) {
+            ERROR("cannot set up %s\n", g.cfg.name);
+            return EXIT_FAILURE;
+          }
+        }
+      }
+    }
+  }
+
+  LOG("%u images compared, %u differ\n", g.checked, g.failed);
+  return g.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
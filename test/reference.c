@@ -0,0 +1,173 @@
+/*
+ * Reference Rasteriser.
+ * The drawing code as it was before any optimisation: one bounds-checked
+ * store per pixel, the textbook Bresenham loops, trig for every point of a
+ * timetable. It is slow and meant to stay that way; the golden test holds
+ * the optimised paths against it. Do not optimise it.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reference.h"
+
+void ref_clear(struct ref_canvas *c) {
+  memset(c->map, 0, (size_t)c->stride * c->height);
+}
+
+void ref_plot(struct ref_canvas *c, int x, int y, uint32_t pixel) {
+  uint8_t *p;
+
+  if (x < 0 || y < 0 || x >= (int)c->width || y >= (int)c->height)
+    return;
+  p = c->map + (size_t)y * c->stride + (size_t)x * c->cpp;
+  if (c->cpp == 2)
+    *(uint16_t *)p = pixel;
+  else
+    *(uint32_t *)p = pixel;
+}
+
+void ref_line(struct ref_canvas *c, vec2 p0, vec2 p1, uint32_t pixel) {
+  vec2 d;
+  d.x = abs(p1.x - p0.x);
+  int sx = p0.x < p1.x ? 1 : -1;
+  d.y = -abs(p1.y - p0.y);
+  int sy = p0.y < p1.y ? 1 : -1;
+  int err = d.x + d.y;
+  int e2;
+  while (1) {
+    ref_plot(c, p0.x, p0.y, pixel);
+    if (p0.x == p1.x && p0.y == p1.y)
+      break;
+    e2 = 2 * err;
+    if (e2 >= d.y) {
+      err += d.y;
+      p0.x += sx;
+    }
+    if (e2 <= d.x) {
+      err += d.x;
+      p0.y += sy;
+    }
+  }
+}
+
+/* the outline of an ellipse, handing every pixel to put */
+static void ellipse_walk(vec2 m, int a, int b,
+                         void (*put)(void *arg, int x, int y), void *arg) {
+  vec2 d;
+  d.x = 0;
+  d.y = b;
+  int64_t a2 = (int64_t)a * a, b2 = (int64_t)b * b;
+  int64_t err = b2 - (2 * b - 1) * a2, e2;
+
+  if (a == 0 && b == 0) {
+    put(arg, m.x, m.y);
+    return;
+  }
+  do {
+    put(arg, m.x + d.x, m.y + d.y);
+    put(arg, m.x - d.x, m.y + d.y);
+    put(arg, m.x - d.x, m.y - d.y);
+    put(arg, m.x + d.x, m.y - d.y);
+
+    e2 = 2 * err;
+    if (e2 < (2 * d.x + 1) * b2) {
+      d.x++;
+      err += (2 * d.x + 1) * b2;
+    }
+    if (e2 > -(2 * d.y - 1) * a2) {
+      d.y--;
+      err -= (2 * d.y - 1) * a2;
+    }
+  } while (d.y >= 0);
+
+  while (d.x++ < a) {
+    put(arg, m.x + d.x, m.y);
+    put(arg, m.x - d.x, m.y);
+  }
+}
+
+struct plot_arg {
+  struct ref_canvas *c;
+  uint32_t pixel;
+};
+
+static void put_plot(void *arg, int x, int y) {
+  struct plot_arg *p = arg;
+
+  ref_plot(p->c, x, y, p->pixel);
+}
+
+void ref_ellipse(struct ref_canvas *c, vec2 m, int a, int b, uint32_t pixel) {
+  struct plot_arg arg = {c, pixel};
+
+  if (a < 0 || b < 0)
+    return;
+  ellipse_walk(m, a, b, put_plot, &arg);
+}
+
+/* leftmost and rightmost outline pixel of every row */
+struct extent_arg {
+  int top;
+  int *x0, *x1;
+};
+
+static void put_extent(void *arg, int x, int y) {
+  struct extent_arg *e = arg;
+  int row = y - e->top;
+
+  if (x < e->x0[row])
+    e->x0[row] = x;
+  if (x > e->x1[row])
+    e->x1[row] = x;
+}
+
+/* everything between the leftmost and rightmost outline pixel of a row */
+void ref_fill_ellipse(struct ref_canvas *c, vec2 m, int a, int b,
+                      uint32_t pixel) {
+  struct extent_arg e = {m.y - b, NULL, NULL};
+
+  if (a < 0 || b < 0)
+    return;
+  e.x0 = malloc((2 * b + 1) * sizeof(int));
+  e.x1 = malloc((2 * b + 1) * sizeof(int));
+  if (!e.x0 || !e.x1)
+    abort();
+  for (int i = 0; i <= 2 * b; i++) {
+    e.x0[i] = m.x + a + 1;
+    e.x1[i] = m.x - a - 1;
+  }
+  ellipse_walk(m, a, b, put_extent, &e);
+  for (int i = 0; i <= 2 * b; i++)
+    for (int x = e.x0[i]; x <= e.x1[i]; x++)
+      ref_plot(c, x, e.top + i, pixel);
+  free(e.x0);
+  free(e.x1);
+}
+
+/* One timetable: the circle, then line i from point i to point
+ * floor(i * step) mod n, step being Q16.16 */
+void ref_tt_figure(struct ref_canvas *c, vec2 pos, int r, size_t n,
+                   uint32_t step, uint32_t pixel) {
+  double a = (M_PI * 2) / n;
+  vec2 p1, p2;
+
+  ref_ellipse(c, pos, r, r, pixel);
+  for (size_t i = 0; i < n; i++) {
+    size_t j = ((uint64_t)i * step >> TT_STEP_SHIFT) % n;
+
+    p1.x = pos.x + r * cos(a * i);
+    p1.y = pos.y + r * sin(a * i);
+    p2.x = pos.x + r * cos(a * j);
+    p2.y = pos.y + r * sin(a * j);
+    ref_line(c, p1, p2, pixel);
+  }
+}
+
+/* a timetable frame: cleared, then the timetable */
+void ref_tt_frame(struct ref_canvas *c, vec2 pos, int r, size_t n,
+                  uint32_t step, uint32_t pixel) {
+  ref_clear(c);
+  ref_tt_figure(c, pos, r, n, step, pixel);
+}
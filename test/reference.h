@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <draw.h>
+
+/* Plain memory the reference rasteriser draws into, laid out like a
+ * drm_buf: stride bytes per row, cpp bytes per pixel. */
+struct ref_canvas {
+  uint8_t *map;
+  uint32_t width, height, stride, cpp;
+};
+
+void ref_clear(struct ref_canvas *c);
+void ref_plot(struct ref_canvas *c, int x, int y, uint32_t pixel);
+void ref_line(struct ref_canvas *c, vec2 p0, vec2 p1, uint32_t pixel);
+void ref_ellipse(struct ref_canvas *c, vec2 m, int a, int b, uint32_t pixel);
+void ref_fill_ellipse(struct ref_canvas *c, vec2 m, int a, int b,
+                      uint32_t pixel);
+void ref_tt_figure(struct ref_canvas *c, vec2 pos, int r, size_t n,
+                   uint32_t step, uint32_t pixel);
+void ref_tt_frame(struct ref_canvas *c, vec2 pos, int r, size_t n,
+                  uint32_t step, uint32_t pixel);